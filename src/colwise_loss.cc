@@ -0,0 +1,191 @@
+#include "colwise_loss.h"
+
+#include <cassert>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace cnn {
+
+// Returns log(sum(exp(col[0..rows))))
+static float LogSumExp(const float* col, unsigned rows) {
+  float m = col[0];
+  for (unsigned k = 1; k < rows; ++k) {
+    m = (col[k] > m) ? col[k] : m;
+  }
+  float z = 0.0f;
+  for (unsigned k = 0; k < rows; ++k) {
+    z += expf(col[k] - m);
+  }
+  return m + logf(z);
+}
+
+string ColwisePickNegLogSoftmax::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "colwise_log_softmax(" << arg_names[0] << ")_{" << labels.size() << " labels}";
+  return s.str();
+}
+
+Dim ColwisePickNegLogSoftmax::dim_forward(const vector<Dim>& xs) const {
+  assert (xs.size() == 1);
+  assert (xs[0].cols() == labels.size());
+  assert (weights.size() == 0 || weights.size() == labels.size());
+  return Dim({1});
+}
+
+// Stores the log partition function of each column for the backward pass
+size_t ColwisePickNegLogSoftmax::aux_storage_size() const {
+  return labels.size() * sizeof(float);
+}
+
+void ColwisePickNegLogSoftmax::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  const Tensor& x = *xs[0];
+  const unsigned rows = x.d.rows();
+  float* log_z = static_cast<float*>(aux_mem);
+  float loss = 0.0f;
+  for (unsigned j = 0; j < labels.size(); ++j) {
+    assert (labels[j] < rows);
+    const float* col = x.v + j * rows;
+    log_z[j] = LogSumExp(col, rows);
+    loss += (weights.size() > 0 ? weights[j] : 1.0f) * (log_z[j] - col[labels[j]]);
+  }
+  fx.v[0] = loss;
+}
+
+void ColwisePickNegLogSoftmax::backward_impl(const vector<const Tensor*>& xs,
+                                         const Tensor& fx,
+                                         const Tensor& dEdf,
+                                         unsigned i,
+                                         Tensor& dEdxi) const {
+  assert (i == 0);
+  const Tensor& x = *xs[0];
+  const unsigned rows = x.d.rows();
+  const float* log_z = static_cast<const float*>(aux_mem);
+  for (unsigned j = 0; j < labels.size(); ++j) {
+    const float d = dEdf.v[0] * (weights.size() > 0 ? weights[j] : 1.0f);
+    const float* col = x.v + j * rows;
+    float* dcol = dEdxi.v + j * rows;
+    for (unsigned k = 0; k < rows; ++k) {
+      dcol[k] += d * expf(col[k] - log_z[j]);
+    }
+    dcol[labels[j]] -= d;
+  }
+}
+
+string ColwiseSoftmaxCrossEntropy::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "colwise_softmax_cross_entropy(" << arg_names[0] << ")";
+  return s.str();
+}
+
+Dim ColwiseSoftmaxCrossEntropy::dim_forward(const vector<Dim>& xs) const {
+  assert (xs.size() == 1);
+  assert (xs[0].cols() == columns);
+  assert (xs[0].size() == targets.size());
+  return Dim({1});
+}
+
+// Stores the log partition function of each column for the backward pass
+size_t ColwiseSoftmaxCrossEntropy::aux_storage_size() const {
+  return columns * sizeof(float);
+}
+
+void ColwiseSoftmaxCrossEntropy::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  const Tensor& x = *xs[0];
+  const unsigned rows = x.d.rows();
+  const unsigned cols = x.d.cols();
+  float* log_z = static_cast<float*>(aux_mem);
+  float loss = 0.0f;
+  for (unsigned j = 0; j < cols; ++j) {
+    const float* col = x.v + j * rows;
+    const float* target = targets.data() + j * rows;
+    log_z[j] = LogSumExp(col, rows);
+    for (unsigned k = 0; k < rows; ++k) {
+      loss += target[k] * (log_z[j] - col[k]);
+    }
+  }
+  fx.v[0] = loss;
+}
+
+void ColwiseSoftmaxCrossEntropy::backward_impl(const vector<const Tensor*>& xs,
+                                           const Tensor& fx,
+                                           const Tensor& dEdf,
+                                           unsigned i,
+                                           Tensor& dEdxi) const {
+  assert (i == 0);
+  const Tensor& x = *xs[0];
+  const unsigned rows = x.d.rows();
+  const unsigned cols = x.d.cols();
+  const float* log_z = static_cast<const float*>(aux_mem);
+  const float d = dEdf.v[0];
+  for (unsigned j = 0; j < cols; ++j) {
+    const float* col = x.v + j * rows;
+    const float* target = targets.data() + j * rows;
+    float* dcol = dEdxi.v + j * rows;
+    float target_mass = 0.0f;
+    for (unsigned k = 0; k < rows; ++k) {
+      target_mass += target[k];
+    }
+    for (unsigned k = 0; k < rows; ++k) {
+      dcol[k] += d * (target_mass * expf(col[k] - log_z[j]) - target[k]);
+    }
+  }
+}
+
+string ColwiseSelect::as_string(const vector<string>& arg_names) const {
+  ostringstream s;
+  s << "colwise_select(" << arg_names[0] << ")_{" << columns.size() << " columns}";
+  return s.str();
+}
+
+Dim ColwiseSelect::dim_forward(const vector<Dim>& xs) const {
+  assert (xs.size() == 1);
+  assert (columns.size() > 0);
+  for (unsigned j : columns) {
+    assert (j < xs[0].cols());
+  }
+  if (columns.size() == 1) {
+    return Dim({(long)xs[0].rows()});
+  }
+  return Dim({(long)xs[0].rows(), (long)columns.size()});
+}
+
+void ColwiseSelect::forward_impl(const vector<const Tensor*>& xs, Tensor& fx) const {
+  const Tensor& x = *xs[0];
+  const unsigned rows = x.d.rows();
+  for (unsigned j = 0; j < columns.size(); ++j) {
+    copy(x.v + columns[j] * rows, x.v + (columns[j] + 1) * rows, fx.v + j * rows);
+  }
+}
+
+void ColwiseSelect::backward_impl(const vector<const Tensor*>& xs,
+                              const Tensor& fx,
+                              const Tensor& dEdf,
+                              unsigned i,
+                              Tensor& dEdxi) const {
+  assert (i == 0);
+  const unsigned rows = xs[0]->d.rows();
+  for (unsigned j = 0; j < columns.size(); ++j) {
+    const float* dcol = dEdf.v + j * rows;
+    float* dxcol = dEdxi.v + columns[j] * rows;
+    for (unsigned k = 0; k < rows; ++k) {
+      dxcol[k] += dcol[k];
+    }
+  }
+}
+
+Expression colwise_pickneglogsoftmax(const Expression& x, const vector<unsigned>& labels, const vector<float>& weights) {
+  return Expression(x.pg, x.pg->add_function<ColwisePickNegLogSoftmax>({x.i}, labels, weights));
+}
+
+Expression colwise_softmax_cross_entropy(const Expression& x, unsigned columns, const vector<float>& targets) {
+  return Expression(x.pg, x.pg->add_function<ColwiseSoftmaxCrossEntropy>({x.i}, columns, targets));
+}
+
+Expression colwise_select(const Expression& x, const vector<unsigned>& columns) {
+  return Expression(x.pg, x.pg->add_function<ColwiseSelect>({x.i}, columns));
+}
+
+} // namespace cnn
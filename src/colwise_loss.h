@@ -0,0 +1,75 @@
+#ifndef CNN_COLWISE_LOSS_H_
+#define CNN_COLWISE_LOSS_H_
+
+#include <vector>
+#include <string>
+
+#include "cnn/cnn.h"
+#include "cnn/expr.h"
+#include "cnn/nodes.h"
+
+using namespace cnn::expr;
+
+namespace cnn {
+
+// Treats each column of x as the unnormalized log probabilities of one
+// example, and computes the sum over columns of -log softmax(x_j)[labels[j]]
+// as a single node. If weights is not empty, column j's term is multiplied
+// by weights[j].
+struct ColwisePickNegLogSoftmax : public Node {
+  template <typename T> explicit ColwisePickNegLogSoftmax(const T& a, const std::vector<unsigned>& labels, const std::vector<float>& weights) : Node(a), labels(labels), weights(weights) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  std::vector<unsigned> labels;
+  std::vector<float> weights;
+};
+
+// Like ColwisePickNegLogSoftmax, but against a target distribution for
+// each column: computes -sum_j sum_k targets_jk * log softmax(x_j)_k.
+// targets is stored column-major, with the same shape as x. x's column
+// count is given up front, since it sizes the node's aux storage.
+struct ColwiseSoftmaxCrossEntropy : public Node {
+  template <typename T> explicit ColwiseSoftmaxCrossEntropy(const T& a, unsigned columns, const std::vector<float>& targets) : Node(a), columns(columns), targets(targets) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  size_t aux_storage_size() const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  unsigned columns;
+  std::vector<float> targets;
+};
+
+// Gathers the given columns of x, in order, into a new matrix (or a vector,
+// if there's only one). Lets a product over many columns be computed once
+// and then used piece by piece.
+struct ColwiseSelect : public Node {
+  template <typename T> explicit ColwiseSelect(const T& a, const std::vector<unsigned>& columns) : Node(a), columns(columns) {}
+  std::string as_string(const std::vector<std::string>& arg_names) const override;
+  Dim dim_forward(const std::vector<Dim>& xs) const override;
+  void forward_impl(const std::vector<const Tensor*>& xs, Tensor& fx) const override;
+  void backward_impl(const std::vector<const Tensor*>& xs,
+                  const Tensor& fx,
+                  const Tensor& dEdf,
+                  unsigned i,
+                  Tensor& dEdxi) const override;
+  std::vector<unsigned> columns;
+};
+
+Expression colwise_pickneglogsoftmax(const Expression& x, const std::vector<unsigned>& labels, const std::vector<float>& weights = {});
+Expression colwise_softmax_cross_entropy(const Expression& x, unsigned columns, const std::vector<float>& targets);
+Expression colwise_select(const Expression& x, const std::vector<unsigned>& columns);
+
+} // namespace cnn
+
+#endif
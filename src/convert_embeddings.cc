@@ -0,0 +1,66 @@
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "embeddings.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// Converts pretrained word vectors from text to the binary format that
+// train --pretrained_embeddings maps. This only needs doing once per file.
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("input", po::value<string>()->required(), "Word vectors in word2vec or GloVe text format")
+  ("output", po::value<string>()->required(), "File to write the binary embeddings to")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("input", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string input_filename = vm["input"].as<string>();
+  const string output_filename = vm["output"].as<string>();
+  ifstream in(input_filename);
+  if (!in.is_open()) {
+    cerr << "ERROR: Unable to read " << input_filename << endl;
+    return 1;
+  }
+  ofstream out(output_filename, ios::binary);
+  if (!out.is_open()) {
+    cerr << "ERROR: Unable to write " << output_filename << endl;
+    return 1;
+  }
+
+  unsigned word_count = 0;
+  unsigned skipped_count = 0;
+  if (!PretrainedEmbeddings::Convert(in, out, &word_count, &skipped_count)) {
+    return 1;
+  }
+  out.close();
+
+  PretrainedEmbeddings embeddings;
+  if (!embeddings.Map(output_filename)) {
+    cerr << "ERROR: " << output_filename << " was written, but can't be mapped" << endl;
+    return 1;
+  }
+  cerr << "Converted " << word_count << " words with " << embeddings.dim() << " dimensions";
+  if (skipped_count > 0) {
+    cerr << ", skipping " << skipped_count << " malformed or repeated lines";
+  }
+  cerr << endl;
+  return 0;
+}
@@ -0,0 +1,275 @@
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include "corpus.h"
+
+// Returns the offset of the first line that starts at or after offset
+static size_t NextLineStart(ifstream& f, size_t offset, size_t file_size) {
+  if (offset == 0 || offset >= file_size) {
+    return min(offset, file_size);
+  }
+  f.clear();
+  f.seekg(offset - 1);
+  string rest;
+  getline(f, rest);
+  return f.eof() ? file_size : (size_t)f.tellg();
+}
+
+// Parses the lines in [begin, end) into trees, or just counts them if trees is null
+static void ReadShard(const string& filename, size_t begin, size_t end, size_t file_size, Vocabulary* dict, vector<SyntaxTree>* trees, unsigned* count) {
+  ifstream f(filename, ios::binary);
+  size_t start = NextLineStart(f, begin, file_size);
+  size_t stop = NextLineStart(f, end, file_size);
+  f.clear();
+  f.seekg(start);
+  for (size_t position = start; position < stop; position = (f.eof() ? file_size : (size_t)f.tellg())) {
+    string line;
+    if (!getline(f, line)) {
+      break;
+    }
+    SyntaxTree tree(line, dict);
+    (*count)++;
+    if (trees != nullptr) {
+      tree.AssignNodeIds();
+      trees->push_back(move(tree));
+    }
+  }
+}
+
+// Reads filename on num_threads threads, adding its words to dict. Appends
+// its trees to data unless data is null. Returns false if it can't be read.
+static bool ReadFile(const string& filename, Vocabulary* dict, unsigned num_threads, vector<SyntaxTree>* data, unsigned* tree_count) {
+  ifstream f(filename, ios::binary | ios::ate);
+  if (!f.is_open()) {
+    return false;
+  }
+  const size_t file_size = f.tellg();
+  f.close();
+
+  num_threads = max(num_threads, 1U);
+  vector<unique_ptr<Vocabulary>> shard_dicts(num_threads);
+  vector<vector<SyntaxTree>> shard_trees(num_threads);
+  vector<unsigned> shard_counts(num_threads);
+  vector<thread> threads;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    shard_dicts[i].reset(new Vocabulary());
+    size_t begin = file_size * i / num_threads;
+    size_t end = file_size * (i + 1) / num_threads;
+    threads.push_back(thread(ReadShard, filename, begin, end, file_size, shard_dicts[i].get(), (data != nullptr) ? &shard_trees[i] : nullptr, &shard_counts[i]));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+
+  if (data != nullptr) {
+    size_t total = data->size();
+    for (const vector<SyntaxTree>& trees : shard_trees) {
+      total += trees.size();
+    }
+    data->reserve(total);
+  }
+
+  // Each shard dictionary lists words in order of first appearance within
+  // its shard, so adding them shard by shard preserves the order in which
+  // a single thread would have seen them.
+  for (unsigned i = 0; i < num_threads; ++i) {
+    vector<WordId> mapping(shard_dicts[i]->size());
+    for (unsigned j = 0; j < mapping.size(); ++j) {
+      mapping[j] = dict->Convert(shard_dicts[i]->Convert(j), shard_dicts[i]->Length(j));
+    }
+    for (SyntaxTree& tree : shard_trees[i]) {
+      tree.RemapLabels(mapping, dict);
+    }
+    if (data != nullptr) {
+      data->insert(data->end(), make_move_iterator(shard_trees[i].begin()), make_move_iterator(shard_trees[i].end()));
+    }
+    vector<SyntaxTree>().swap(shard_trees[i]);
+    *tree_count += shard_counts[i];
+  }
+  return true;
+}
+
+vector<SyntaxTree>* ReadTrees(const string& filename, Vocabulary* dict, unsigned num_threads) {
+  vector<SyntaxTree>* data = new vector<SyntaxTree>();
+  unsigned tree_count = 0;
+  if (!ReadFile(filename, dict, num_threads, data, &tree_count)) {
+    delete data;
+    return nullptr;
+  }
+  return data;
+}
+
+bool OpenShard(const string& filename, unsigned shard, unsigned shard_count, ifstream* f, size_t* stop) {
+  f->open(filename, ios::binary | ios::ate);
+  if (!f->is_open()) {
+    return false;
+  }
+  const size_t file_size = f->tellg();
+  const size_t start = NextLineStart(*f, file_size * shard / shard_count, file_size);
+  *stop = NextLineStart(*f, file_size * (shard + 1) / shard_count, file_size);
+  f->clear();
+  f->seekg(start);
+  return true;
+}
+
+bool ScanVocabulary(const vector<string>& filenames, Vocabulary* dict, unsigned num_threads, unsigned* tree_count) {
+  *tree_count = 0;
+  for (const string& filename : filenames) {
+    if (!ReadFile(filename, dict, num_threads, nullptr, tree_count)) {
+      cerr << "ERROR: Unable to read " << filename << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Only internal nodes have sentiment labels
+static unsigned Sentiment(const SyntaxTree& tree) {
+  return tree.IsTerminal() ? 0 : tree.sentiment();
+}
+
+// Hashes everything about a tree that affects its loss
+static uint64_t HashTree(const SyntaxTree& tree) {
+  uint64_t h = ((uint64_t)(uint32_t)tree.label() << 32) ^ ((uint64_t)Sentiment(tree) << 16) ^ tree.NumChildren();
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    h = (h * 0x100000001b3ULL) ^ HashTree(tree.GetChild(i));
+  }
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+static bool SameTree(const SyntaxTree& a, const SyntaxTree& b) {
+  if (a.label() != b.label() || Sentiment(a) != Sentiment(b) || a.NumChildren() != b.NumChildren()) {
+    return false;
+  }
+  for (unsigned i = 0; i < a.NumChildren(); ++i) {
+    if (!SameTree(a.GetChild(i), b.GetChild(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+vector<unsigned> DeduplicateTrees(vector<SyntaxTree>* trees) {
+  // Maps each hash to the positions of the kept trees that have it
+  unordered_map<uint64_t, vector<unsigned>> kept;
+  vector<unsigned> counts;
+  unsigned size = 0;
+  for (unsigned i = 0; i < trees->size(); ++i) {
+    vector<unsigned>& candidates = kept[HashTree((*trees)[i])];
+    bool found = false;
+    for (unsigned j : candidates) {
+      if (SameTree((*trees)[j], (*trees)[i])) {
+        counts[j]++;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      if (size != i) {
+        (*trees)[size] = move((*trees)[i]);
+      }
+      candidates.push_back(size++);
+      counts.push_back(1);
+    }
+  }
+  trees->resize(size);
+  return counts;
+}
+
+TreeStream::TreeStream(const vector<string>& filenames, Vocabulary* dict, unsigned buffer_size, unsigned seed) :
+  filenames(filenames), dict(dict), buffer_size(max(buffer_size, 1U)), seed(seed), finished(false), stopping(false), failed_(false) {
+  assert (dict->is_frozen());
+  reader = thread(&TreeStream::Read, this);
+}
+
+TreeStream::~TreeStream() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  not_full.notify_all();
+  reader.join();
+}
+
+unique_ptr<SyntaxTree> TreeStream::Next() {
+  unique_lock<mutex> guard(lock);
+  not_empty.wait(guard, [this] { return ready.size() > 0 || finished; });
+  if (ready.size() == 0) {
+    return nullptr;
+  }
+  unique_ptr<SyntaxTree> tree = move(ready.front());
+  ready.pop_front();
+  guard.unlock();
+  not_full.notify_one();
+  return tree;
+}
+
+bool TreeStream::failed() const {
+  lock_guard<mutex> guard(lock);
+  return failed_;
+}
+
+// Hands a tree over to Next(), waiting while the queue is full.
+// Returns false if the stream is being torn down.
+bool TreeStream::Emit(unique_ptr<SyntaxTree> tree) {
+  unique_lock<mutex> guard(lock);
+  not_full.wait(guard, [this] { return ready.size() < queue_size || stopping; });
+  if (stopping) {
+    return false;
+  }
+  ready.push_back(move(tree));
+  guard.unlock();
+  not_empty.notify_one();
+  return true;
+}
+
+void TreeStream::Read() {
+  mt19937 rng(seed);
+  vector<string> order = filenames;
+  shuffle(order.begin(), order.end(), rng);
+
+  // Once the reservoir is full, each new tree takes the place of a random
+  // one, which is passed on
+  vector<unique_ptr<SyntaxTree>> reservoir;
+  bool ok = true;
+  for (unsigned i = 0; i < order.size() && ok; ++i) {
+    ifstream f(order[i]);
+    if (!f.is_open()) {
+      cerr << "ERROR: Unable to read " << order[i] << endl;
+      lock_guard<mutex> guard(lock);
+      failed_ = true;
+      break;
+    }
+    for (string line; ok && getline(f, line);) {
+      unique_ptr<SyntaxTree> tree(new SyntaxTree(line, dict));
+      tree->AssignNodeIds();
+      if (reservoir.size() < buffer_size) {
+        reservoir.push_back(move(tree));
+      }
+      else {
+        unsigned j = uniform_int_distribution<unsigned>(0, buffer_size - 1)(rng);
+        swap(reservoir[j], tree);
+        ok = Emit(move(tree));
+      }
+    }
+  }
+
+  shuffle(reservoir.begin(), reservoir.end(), rng);
+  for (unsigned i = 0; i < reservoir.size() && ok; ++i) {
+    ok = Emit(move(reservoir[i]));
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    finished = true;
+  }
+  not_empty.notify_all();
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <condition_variable>
+#include "syntax_tree.h"
+
+using namespace std;
+
+// Reads one tree per line from filename, splitting the file into byte
+// ranges that are parsed on num_threads threads at once. Each thread
+// interns words into its own dictionary; these are then merged into dict
+// in file order, so the trees and dict come out the same no matter how
+// many threads are used. Returns nullptr if the file can't be read.
+vector<SyntaxTree>* ReadTrees(const string& filename, Vocabulary* dict, unsigned num_threads = 1);
+
+// Adds every word in filenames to dict, in the same order ReadTrees() would,
+// and counts their trees. Nothing else is kept in memory.
+bool ScanVocabulary(const vector<string>& filenames, Vocabulary* dict, unsigned num_threads, unsigned* tree_count);
+
+// Opens shard of shard_count equal byte ranges of filename, positioning f
+// at its first line and setting stop to the offset where its lines end.
+// Each line belongs to the range holding its first byte, so the shards
+// cover every line exactly once without the file being scanned first.
+bool OpenShard(const string& filename, unsigned shard, unsigned shard_count, ifstream* f, size_t* stop);
+
+// Collapses trees that are identical, in shape, words and labels, into
+// their first copy, keeping the first copies in order. Returns how many
+// copies each remaining tree stands for.
+vector<unsigned> DeduplicateTrees(vector<SyntaxTree>* trees);
+
+// Streams the trees of several files in a shuffled order, holding at most
+// about buffer_size of them in memory at once. A background thread reads
+// the files one after another, in a random order, into a reservoir of
+// buffer_size trees; each tree read after the reservoir is full replaces a
+// random tree in it, which is passed on. dict must be frozen.
+class TreeStream {
+public:
+  TreeStream(const vector<string>& filenames, Vocabulary* dict, unsigned buffer_size, unsigned seed);
+  ~TreeStream();
+  TreeStream(const TreeStream&) = delete;
+  TreeStream& operator=(const TreeStream&) = delete;
+
+  // Returns nullptr once every tree has been returned
+  unique_ptr<SyntaxTree> Next();
+  // Whether some file could not be read
+  bool failed() const;
+
+private:
+  void Read();
+  bool Emit(unique_ptr<SyntaxTree> tree);
+
+  // Trees that have left the reservoir but not yet been returned
+  static const unsigned queue_size = 256;
+
+  const vector<string> filenames;
+  Vocabulary* dict;
+  const unsigned buffer_size;
+  const unsigned seed;
+
+  deque<unique_ptr<SyntaxTree>> ready;
+  bool finished;
+  bool stopping;
+  bool failed_;
+  mutable mutex lock;
+  condition_variable not_empty;
+  condition_variable not_full;
+  thread reader;
+};
@@ -0,0 +1,163 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "embeddings.h"
+
+namespace {
+const uint64_t kEmbeddingsMagic = 0x31304445424d4553ULL; // "SEMBED01", little-endian
+
+// The matrix starts right after the header, and the vocabulary blob at
+// vocab_offset, which is a multiple of 8
+struct EmbeddingsHeader {
+  uint64_t magic;
+  uint64_t dim;
+  uint64_t count;
+  uint64_t vocab_offset;
+};
+
+size_t Align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+// Parses the values following a word, returning false if anything but
+// numbers and whitespace is left over
+bool ParseValues(const char* p, vector<float>* values) {
+  values->clear();
+  while (true) {
+    char* end;
+    float value = strtof(p, &end);
+    if (end == p) {
+      break;
+    }
+    values->push_back(value);
+    p = end;
+  }
+  while (isspace((unsigned char)*p)) {
+    ++p;
+  }
+  return *p == '\0';
+}
+} // namespace
+
+PretrainedEmbeddings::PretrainedEmbeddings() : matrix(nullptr), dim_(0), mapping(nullptr), mapping_length(0) {}
+
+PretrainedEmbeddings::~PretrainedEmbeddings() {
+  Unmap();
+}
+
+void PretrainedEmbeddings::Unmap() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_length);
+    mapping = nullptr;
+    mapping_length = 0;
+  }
+}
+
+unsigned PretrainedEmbeddings::size() const {
+  return words.size();
+}
+
+bool PretrainedEmbeddings::Map(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(EmbeddingsHeader)) {
+    close(fd);
+    return false;
+  }
+  void* region = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    return false;
+  }
+  // Rows are looked up in no particular order, so reading ahead is wasted
+  madvise(region, st.st_size, MADV_RANDOM);
+
+  const char* data = (const char*)region;
+  const size_t length = st.st_size;
+  EmbeddingsHeader header;
+  memcpy(&header, data, sizeof(header));
+  // The matrix's size is only computed once it's known not to overflow
+  const bool fits = header.dim > 0 && header.count <= (SIZE_MAX - sizeof(header)) / sizeof(float) / header.dim;
+  const size_t matrix_end = fits ? sizeof(header) + header.count * header.dim * sizeof(float) : SIZE_MAX;
+  if (header.magic != kEmbeddingsMagic || !fits || header.vocab_offset < matrix_end || header.vocab_offset % 8 != 0 || header.vocab_offset >= length ||
+      words.MapFrom(data + header.vocab_offset, length - header.vocab_offset) == 0 || words.size() != header.count) {
+    // words may point into region, or into the mapping about to be
+    // released, so it's emptied first
+    words.Clear();
+    Unmap();
+    matrix = nullptr;
+    dim_ = 0;
+    munmap(region, length);
+    return false;
+  }
+
+  Unmap();
+  matrix = (const float*)(data + sizeof(header));
+  dim_ = header.dim;
+  mapping = region;
+  mapping_length = length;
+  return true;
+}
+
+bool PretrainedEmbeddings::Convert(istream& in, ostream& out, unsigned* word_count, unsigned* skipped_count) {
+  EmbeddingsHeader header = {kEmbeddingsMagic, 0, 0, 0};
+  out.write((const char*)&header, sizeof(header));
+
+  // Rows are written as they're read, so the text is never held in memory
+  Vocabulary words;
+  vector<float> values;
+  *skipped_count = 0;
+  bool first_line = true;
+  for (string line; getline(in, line);) {
+    const size_t space = line.find(' ');
+    const bool parsed = space != 0 && space != string::npos && ParseValues(line.c_str() + space, &values);
+    if (first_line) {
+      first_line = false;
+      // word2vec's header line, which sets the dimensions
+      if (parsed && values.size() == 1 && line.find_first_not_of("0123456789") == space) {
+        header.dim = (uint64_t)values[0];
+        continue;
+      }
+    }
+    if (line.find_first_not_of(" \t\r") == string::npos) {
+      continue;
+    }
+    if (parsed && header.dim == 0) {
+      header.dim = values.size();
+    }
+    if (!parsed || values.size() != header.dim || header.dim == 0 || words.Contains(line.c_str(), space)) {
+      ++*skipped_count;
+      continue;
+    }
+    words.Convert(line.c_str(), space);
+    out.write((const char*)values.data(), values.size() * sizeof(float));
+  }
+  if (in.bad() || words.size() == 0) {
+    cerr << "ERROR: No embeddings were read" << endl;
+    return false;
+  }
+
+  words.Freeze();
+  header.count = words.size();
+  const size_t matrix_end = sizeof(header) + header.count * header.dim * sizeof(float);
+  header.vocab_offset = Align8(matrix_end);
+  out.write(string(header.vocab_offset - matrix_end, '\0').data(), header.vocab_offset - matrix_end);
+  words.SaveBlob(out);
+  out.seekp(0);
+  out.write((const char*)&header, sizeof(header));
+  out.flush();
+  if (!out) {
+    cerr << "ERROR: Unable to write the embeddings" << endl;
+    return false;
+  }
+  *word_count = header.count;
+  return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <iostream>
+#include "vocabulary.h"
+
+using namespace std;
+
+// Pretrained word vectors in a binary file that is memory-mapped rather
+// than read, so that only the pages holding the rows actually used are
+// ever loaded. A file holds a small header, the vectors as one row-major
+// float matrix, and a Vocabulary blob whose ids are the matrix's rows.
+// Files are written once from the usual text format by
+// bin/convert_embeddings.
+class PretrainedEmbeddings {
+public:
+  PretrainedEmbeddings();
+  ~PretrainedEmbeddings();
+  PretrainedEmbeddings(const PretrainedEmbeddings&) = delete;
+  PretrainedEmbeddings& operator=(const PretrainedEmbeddings&) = delete;
+
+  // Returns false if filename can't be mapped or isn't a valid file
+  bool Map(const string& filename);
+  unsigned size() const;
+  // dim() and Find() are inline, so that SentimentModel can use them
+  // without every program linking embeddings.o
+  unsigned dim() const {
+    return dim_;
+  }
+  // Returns word's vector, or nullptr if there is none
+  const float* Find(const char* word, size_t length) const {
+    WordId id = words.Lookup(word, length);
+    return (id >= 0) ? matrix + (size_t)id * dim_ : nullptr;
+  }
+
+  // Converts text with one word per line, followed by its values and
+  // separated by spaces, as written by word2vec and GloVe. A word2vec
+  // "count dim" first line is skipped. Lines with the wrong number of
+  // values and repeated words are skipped and counted. out must be
+  // seekable, since the header is written last.
+  static bool Convert(istream& in, ostream& out, unsigned* word_count, unsigned* skipped_count);
+
+private:
+  void Unmap();
+
+  Vocabulary words;
+  const float* matrix;
+  unsigned dim_;
+  void* mapping;
+  size_t mapping_length;
+};
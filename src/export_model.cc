@@ -0,0 +1,572 @@
+#include "cnn/cnn.h"
+
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "sentiment.h"
+#include "model_io.h"
+#include "native_evaluator.h"
+
+using namespace cnn;
+using namespace std;
+namespace po = boost::program_options;
+
+// The parts of the generated source that don't depend on the model. Each
+// is pasted in as is, around the model's dimensions and weights.
+static const char* kTypes = R"RUNTIME(
+// y += m x, where m is Rows x Cols and stored column-major
+template<unsigned Rows, unsigned Cols>
+inline void MatVec(const float* m, const float* x, float* y) {
+  for (unsigned col = 0; col < Cols; ++col) {
+    const float x_col = x[col];
+    const float* column = m + col * Rows;
+    for (unsigned row = 0; row < Rows; ++row) {
+      y[row] += column[row] * x_col;
+    }
+  }
+}
+
+inline float Logistic(float x) {
+  return 1.0f / (1.0f + std::exp(-x));
+}
+
+// One TreeLSTM layer. Weights indexed by child position hold one matrix
+// per position, and h2f and c2f one per pair of positions.
+struct TreeLayer {
+  const float *x2i, *x2f, *x2o, *x2c;
+  const float *bi, *bf, *bo, *bc;
+  const float *h2i, *h2f, *h2o, *h2c;
+  const float *c2i, *c2f, *c2o;
+};
+
+// One layer of one direction of the leaf BiLSTM, with the input weights
+// of the i, o and c gates stacked in that order
+struct LeafLayer {
+  const float *x2ioc, *b_ioc;
+  const float *h2i, *c2i, *h2o, *c2o, *h2c;
+};
+)RUNTIME";
+
+static const char* kLookupLeaves = R"RUNTIME(
+// Each terminal's input to the TreeLSTM is its word's embedding
+void EncodeLeaves(const std::vector<int>& words, std::vector<float>* leaves) {
+  leaves->resize(words.size() * kLeafDim);
+  for (unsigned t = 0; t < words.size(); ++t) {
+    const float* embedding = kEmbeddings + words[t] * kWordDim;
+    std::copy(embedding, embedding + kWordDim, leaves->data() + t * kLeafDim);
+  }
+}
+)RUNTIME";
+
+static const char* kBiLSTMLeaves = R"RUNTIME(
+// Runs one layer of one direction of the leaf BiLSTM over a sentence, as
+// NativeEvaluator::RunLeafLSTM() does
+template<unsigned InDim>
+void RunLeafLayer(const LeafLayer& layer, const std::vector<float>& inputs, unsigned length, bool reverse, std::vector<float>* outputs) {
+  const unsigned dim = kLeafLSTMDim;
+  outputs->resize(length * dim);
+  float a[3 * kLeafLSTMDim];
+  float h[kLeafLSTMDim];
+  float c[kLeafLSTMDim];
+  float* a_i = a;
+  float* a_o = a + dim;
+  float* a_w = a + 2 * dim;
+  for (unsigned k = 0; k < length; ++k) {
+    const unsigned t = reverse ? length - 1 - k : k;
+    std::copy(layer.b_ioc, layer.b_ioc + 3 * dim, a);
+    MatVec<3 * kLeafLSTMDim, InDim>(layer.x2ioc, &inputs[t * InDim], a);
+    if (k > 0) {
+      MatVec<kLeafLSTMDim, kLeafLSTMDim>(layer.h2i, h, a_i);
+      MatVec<kLeafLSTMDim, kLeafLSTMDim>(layer.c2i, c, a_i);
+      MatVec<kLeafLSTMDim, kLeafLSTMDim>(layer.h2c, h, a_w);
+      MatVec<kLeafLSTMDim, kLeafLSTMDim>(layer.h2o, h, a_o);
+    }
+    for (unsigned r = 0; r < dim; ++r) {
+      const float i_t = Logistic(a_i[r]);
+      c[r] = (k > 0 ? (1.0f - i_t) * c[r] : 0.0f) + i_t * std::tanh(a_w[r]);
+    }
+    MatVec<kLeafLSTMDim, kLeafLSTMDim>(layer.c2o, c, a_o);
+    for (unsigned r = 0; r < dim; ++r) {
+      h[r] = Logistic(a_o[r]) * std::tanh(c[r]);
+    }
+    std::copy(h, h + dim, outputs->data() + t * dim);
+  }
+}
+
+void RunLeafLSTM(const LeafLayer* layers, const std::vector<float>& embedded, unsigned length, bool reverse, std::vector<float>* outputs) {
+  RunLeafLayer<kWordDim>(layers[0], embedded, length, reverse, outputs);
+  for (unsigned i = 1; i < kLeafLayers; ++i) {
+    const std::vector<float> inputs = *outputs;
+    RunLeafLayer<kLeafLSTMDim>(layers[i], inputs, length, reverse, outputs);
+  }
+}
+
+// Each terminal's input to the TreeLSTM is the forward and reverse
+// BiLSTM outputs at its position, stacked
+void EncodeLeaves(const std::vector<int>& words, std::vector<float>* leaves) {
+  const unsigned length = words.size();
+  std::vector<float> embedded(length * kWordDim);
+  for (unsigned t = 0; t < length; ++t) {
+    const float* embedding = kEmbeddings + words[t] * kWordDim;
+    std::copy(embedding, embedding + kWordDim, embedded.data() + t * kWordDim);
+  }
+  std::vector<float> forward, reverse;
+  RunLeafLSTM(kForwardLayers, embedded, length, false, &forward);
+  RunLeafLSTM(kReverseLayers, embedded, length, true, &reverse);
+  leaves->resize(length * kLeafDim);
+  for (unsigned t = 0; t < length; ++t) {
+    float* leaf = leaves->data() + t * kLeafDim;
+    std::copy(&forward[t * kLeafLSTMDim], &forward[(t + 1) * kLeafLSTMDim], leaf);
+    std::copy(&reverse[t * kLeafLSTMDim], &reverse[(t + 1) * kLeafLSTMDim], leaf + kLeafLSTMDim);
+  }
+}
+)RUNTIME";
+
+static const char* kForward = R"RUNTIME(
+struct Node {
+  int terminal; // Index of the node's word in Tree::words, or -1 if it's internal
+  unsigned sentiment;
+  unsigned first_child, child_count; // The node's run of Tree::children
+  unsigned start, end; // Terminals covered
+};
+
+// A tree with its nodes in post-order, so that children come before parents
+struct Tree {
+  std::vector<int> words;
+  std::vector<Node> nodes;
+  std::vector<unsigned> children;
+};
+
+int LookupWord(const std::string& word) {
+  const char* const* end = kWords + kVocabSize;
+  const char* const* it = std::lower_bound(kWords, end, word.c_str(), [](const char* a, const char* b) { return std::strcmp(a, b) < 0; });
+  if (it != end && std::strcmp(*it, word.c_str()) == 0) {
+    return kWordIds[it - kWords];
+  }
+  return kUnk;
+}
+
+// Reads the subtree at text[*pos], moving *pos past it. Returns the index
+// of its root in tree->nodes, or -1 if it can't be read.
+int ParseSubtree(const std::string& text, size_t* pos, Tree* tree) {
+  Node node;
+  node.start = tree->words.size();
+  if (*pos < text.size() && text[*pos] == '(') {
+    size_t label_end = ++*pos;
+    while (label_end < text.size() && text[label_end] >= '0' && text[label_end] <= '9') {
+      label_end++;
+    }
+    if (label_end == *pos) {
+      return -1;
+    }
+    node.sentiment = std::atoi(text.substr(*pos, label_end - *pos).c_str());
+    *pos = label_end;
+
+    std::vector<unsigned> children;
+    while (true) {
+      while (*pos < text.size() && text[*pos] == ' ') {
+        ++*pos;
+      }
+      if (*pos == text.size()) {
+        return -1;
+      }
+      if (text[*pos] == ')') {
+        ++*pos;
+        break;
+      }
+      const int child = ParseSubtree(text, pos, tree);
+      if (child < 0) {
+        return -1;
+      }
+      children.push_back(child);
+    }
+    if (children.size() == 0) {
+      return -1;
+    }
+    node.terminal = -1;
+    node.first_child = tree->children.size();
+    node.child_count = children.size();
+    tree->children.insert(tree->children.end(), children.begin(), children.end());
+  }
+  else {
+    size_t word_end = *pos;
+    while (word_end < text.size() && text[word_end] != ' ' && text[word_end] != '(' && text[word_end] != ')') {
+      word_end++;
+    }
+    const int word = LookupWord(text.substr(*pos, word_end - *pos));
+    if (word_end == *pos || word < 0) {
+      return -1;
+    }
+    *pos = word_end;
+    node.terminal = tree->words.size();
+    node.sentiment = 0;
+    node.first_child = 0;
+    node.child_count = 0;
+    tree->words.push_back(word);
+  }
+  node.end = tree->words.size();
+  tree->nodes.push_back(node);
+  return tree->nodes.size() - 1;
+}
+
+inline float* State(std::vector<float>& states, unsigned id, unsigned layer) {
+  return &states[(id * kLayers + layer) * kNodeDim];
+}
+
+// Computes one layer of a node's state from its input (if any) and its
+// children's states, as NativeEvaluator::EvaluateNode() does
+template<unsigned InDim>
+void EvaluateLayer(const TreeLayer& layer, unsigned layer_index, const float* in, const Tree& tree, unsigned id, std::vector<float>& h, std::vector<float>& c) {
+  const unsigned dim = kNodeDim;
+  const unsigned matrix_size = kNodeDim * kNodeDim;
+  const Node& node = tree.nodes[id];
+  float a_i[kNodeDim], a_o[kNodeDim], a_w[kNodeDim], f_base[kNodeDim], a_f[kNodeDim];
+  std::copy(layer.bi, layer.bi + dim, a_i);
+  std::copy(layer.bo, layer.bo + dim, a_o);
+  std::copy(layer.bc, layer.bc + dim, a_w);
+  std::copy(layer.bf, layer.bf + dim, f_base);
+  if (in != nullptr) {
+    MatVec<kNodeDim, InDim>(layer.x2i, in, a_i);
+    MatVec<kNodeDim, InDim>(layer.x2o, in, a_o);
+    MatVec<kNodeDim, InDim>(layer.x2c, in, a_w);
+    MatVec<kNodeDim, InDim>(layer.x2f, in, f_base);
+  }
+  for (unsigned j = 0; j < node.child_count; ++j) {
+    const unsigned ej = std::min(j, kBranching - 1);
+    const unsigned child = tree.children[node.first_child + j];
+    const float* h_j = State(h, child, layer_index);
+    const float* c_j = State(c, child, layer_index);
+    MatVec<kNodeDim, kNodeDim>(layer.h2i + ej * matrix_size, h_j, a_i);
+    MatVec<kNodeDim, kNodeDim>(layer.c2i + ej * matrix_size, c_j, a_i);
+    MatVec<kNodeDim, kNodeDim>(layer.h2o + ej * matrix_size, h_j, a_o);
+    MatVec<kNodeDim, kNodeDim>(layer.c2o + ej * matrix_size, c_j, a_o);
+    MatVec<kNodeDim, kNodeDim>(layer.h2c + ej * matrix_size, h_j, a_w);
+  }
+
+  float* c_out = State(c, id, layer_index);
+  for (unsigned r = 0; r < dim; ++r) {
+    c_out[r] = Logistic(a_i[r]) * std::tanh(a_w[r]);
+  }
+  for (unsigned k = 0; k < node.child_count; ++k) {
+    const unsigned ek = std::min(k, kBranching - 1);
+    std::copy(f_base, f_base + dim, a_f);
+    for (unsigned j = 0; j < node.child_count; ++j) {
+      const unsigned ej = std::min(j, kBranching - 1);
+      const unsigned child = tree.children[node.first_child + j];
+      MatVec<kNodeDim, kNodeDim>(layer.h2f + (ej * kBranching + ek) * matrix_size, State(h, child, layer_index), a_f);
+      MatVec<kNodeDim, kNodeDim>(layer.c2f + (ej * kBranching + ek) * matrix_size, State(c, child, layer_index), a_f);
+    }
+    const float* c_k = State(c, tree.children[node.first_child + k], layer_index);
+    for (unsigned r = 0; r < dim; ++r) {
+      c_out[r] += Logistic(a_f[r]) * c_k[r];
+    }
+  }
+  float* h_out = State(h, id, layer_index);
+  for (unsigned r = 0; r < dim; ++r) {
+    h_out[r] = Logistic(a_o[r]) * std::tanh(c_out[r]);
+  }
+}
+
+} // namespace
+
+namespace exported_model {
+
+bool Predict(const std::string& text, std::vector<NodePrediction>* predictions, std::vector<std::string>* terminals) {
+  predictions->clear();
+  if (terminals != nullptr) {
+    terminals->clear();
+  }
+  // Parsers output this for sentences they fail on
+  if (text == "()") {
+    return true;
+  }
+
+  Tree tree;
+  size_t pos = 0;
+  if (ParseSubtree(text, &pos, &tree) < 0 || text.find_first_not_of(' ', pos) != std::string::npos) {
+    return false;
+  }
+  if (terminals != nullptr) {
+    for (int word : tree.words) {
+      terminals->push_back(kWords[kWordPositions[word]]);
+    }
+  }
+
+  std::vector<float> leaves;
+  EncodeLeaves(tree.words, &leaves);
+  std::vector<float> h(tree.nodes.size() * kLayers * kNodeDim);
+  std::vector<float> c(tree.nodes.size() * kLayers * kNodeDim);
+  for (unsigned id = 0; id < tree.nodes.size(); ++id) {
+    const Node& node = tree.nodes[id];
+    // Internal nodes have no input
+    const float* in = (node.terminal >= 0) ? &leaves[node.terminal * kLeafDim] : nullptr;
+    EvaluateLayer<kLeafDim>(kTreeLayers[0], 0, in, tree, id, h, c);
+    for (unsigned i = 1; i < kLayers; ++i) {
+      EvaluateLayer<kNodeDim>(kTreeLayers[i], i, State(h, id, i - 1), tree, id, h, c);
+    }
+    if (node.child_count == 0) {
+      continue;
+    }
+
+    float hidden[kHiddenDim];
+    std::copy(kFHb, kFHb + kHiddenDim, hidden);
+    MatVec<kHiddenDim, kNodeDim>(kFIH, State(h, id, kLayers - 1), hidden);
+    for (unsigned r = 0; r < kHiddenDim; ++r) {
+      hidden[r] = std::tanh(hidden[r]);
+    }
+    NodePrediction prediction;
+    prediction.start = node.start;
+    prediction.end = node.end;
+    prediction.sentiment = node.sentiment;
+    prediction.scores.assign(kFOb, kFOb + kLabelCount);
+    MatVec<kLabelCount, kHiddenDim>(kFHO, hidden, prediction.scores.data());
+    predictions->push_back(prediction);
+  }
+  return true;
+}
+
+} // namespace exported_model
+)RUNTIME";
+
+// Writes a NativeEvaluator's weights, and a forward pass specialized to
+// the model's dimensions and branching factor, as a C++ source file that
+// implements exported_model.h with nothing but the standard library
+class ModelExporter {
+public:
+  ModelExporter(const NativeEvaluator& evaluator, const Vocabulary& vocab) : evaluator(evaluator), vocab(vocab) {}
+  void Write(ostream& out, const string& model_filename) const;
+
+private:
+  typedef NativeEvaluator::Matrix Matrix;
+
+  static void WriteArray(ostream& out, const string& name, const vector<const Matrix*>& matrices);
+  static void WriteTreeLayer(ostream& out, const string& name, const NativeEvaluator::Layer& layer);
+  static void WriteLeafLayer(ostream& out, const string& name, const NativeEvaluator::LeafLayer& layer);
+  static void WriteString(ostream& out, const char* s);
+  void WriteVocabulary(ostream& out) const;
+
+  const NativeEvaluator& evaluator;
+  const Vocabulary& vocab;
+};
+
+// Writes the matrices one after another, each column-major, as one aligned
+// array of float literals that round trip exactly
+void ModelExporter::WriteArray(ostream& out, const string& name, const vector<const Matrix*>& matrices) {
+  size_t size = 0;
+  for (const Matrix* m : matrices) {
+    size += m->size();
+  }
+  out << "alignas(64) constexpr float " << name << "[" << size << "] = {";
+  size_t i = 0;
+  char buffer[32];
+  for (const Matrix* m : matrices) {
+    for (unsigned j = 0; j < m->size(); ++j, ++i) {
+      snprintf(buffer, sizeof(buffer), "%.9g", m->data()[j]);
+      out << (i % 8 == 0 ? "\n  " : " ") << buffer;
+      if (strpbrk(buffer, ".e") == nullptr) {
+        out << ".0";
+      }
+      out << "f,";
+    }
+  }
+  out << "\n};\n";
+}
+
+void ModelExporter::WriteTreeLayer(ostream& out, const string& name, const NativeEvaluator::Layer& layer) {
+  auto all = [](const vector<Matrix>& matrices) {
+    vector<const Matrix*> pointers;
+    for (const Matrix& m : matrices) {
+      pointers.push_back(&m);
+    }
+    return pointers;
+  };
+  const Matrix bi = layer.bi, bf = layer.bf, bo = layer.bo, bc = layer.bc;
+  WriteArray(out, name + "_x2i", {&layer.x2i});
+  WriteArray(out, name + "_x2f", {&layer.x2f});
+  WriteArray(out, name + "_x2o", {&layer.x2o});
+  WriteArray(out, name + "_x2c", {&layer.x2c});
+  WriteArray(out, name + "_bi", {&bi});
+  WriteArray(out, name + "_bf", {&bf});
+  WriteArray(out, name + "_bo", {&bo});
+  WriteArray(out, name + "_bc", {&bc});
+  WriteArray(out, name + "_h2i", all(layer.h2i));
+  WriteArray(out, name + "_h2f", all(layer.h2f));
+  WriteArray(out, name + "_h2o", all(layer.h2o));
+  WriteArray(out, name + "_h2c", all(layer.h2c));
+  WriteArray(out, name + "_c2i", all(layer.c2i));
+  WriteArray(out, name + "_c2f", all(layer.c2f));
+  WriteArray(out, name + "_c2o", all(layer.c2o));
+}
+
+void ModelExporter::WriteLeafLayer(ostream& out, const string& name, const NativeEvaluator::LeafLayer& layer) {
+  const Matrix b_ioc = layer.b_ioc;
+  WriteArray(out, name + "_x2ioc", {&layer.x2ioc});
+  WriteArray(out, name + "_b_ioc", {&b_ioc});
+  WriteArray(out, name + "_h2i", {&layer.h2i});
+  WriteArray(out, name + "_c2i", {&layer.c2i});
+  WriteArray(out, name + "_h2o", {&layer.h2o});
+  WriteArray(out, name + "_c2o", {&layer.c2o});
+  WriteArray(out, name + "_h2c", {&layer.h2c});
+}
+
+// Writes s as a string literal, escaping anything but printable ASCII.
+// Octal escapes take at most three digits, so they can't swallow the
+// characters after them.
+void ModelExporter::WriteString(ostream& out, const char* s) {
+  char buffer[8];
+  out << '"';
+  for (; *s != '\0'; ++s) {
+    const unsigned char ch = *s;
+    if (ch == '"' || ch == '\\' || ch == '?' || ch < 0x20 || ch >= 0x7f) {
+      snprintf(buffer, sizeof(buffer), "\\%03o", ch);
+      out << buffer;
+    }
+    else {
+      out << ch;
+    }
+  }
+  out << '"';
+}
+
+// Words are stored sorted, to be found by binary search
+void ModelExporter::WriteVocabulary(ostream& out) const {
+  vector<WordId> sorted(vocab.size());
+  for (unsigned i = 0; i < sorted.size(); ++i) {
+    sorted[i] = i;
+  }
+  sort(sorted.begin(), sorted.end(), [&](WordId a, WordId b) { return strcmp(vocab.Convert(a), vocab.Convert(b)) < 0; });
+  vector<unsigned> positions(vocab.size());
+  out << "constexpr const char* kWords[" << sorted.size() << "] = {\n";
+  for (unsigned i = 0; i < sorted.size(); ++i) {
+    positions[sorted[i]] = i;
+    out << "  ";
+    WriteString(out, vocab.Convert(sorted[i]));
+    out << ",\n";
+  }
+  out << "};\n";
+  out << "constexpr int kWordIds[" << sorted.size() << "] = {";
+  for (unsigned i = 0; i < sorted.size(); ++i) {
+    out << (i % 16 == 0 ? "\n  " : " ") << sorted[i] << ",";
+  }
+  out << "\n};\n";
+  out << "constexpr unsigned kWordPositions[" << positions.size() << "] = {";
+  for (unsigned i = 0; i < positions.size(); ++i) {
+    out << (i % 16 == 0 ? "\n  " : " ") << positions[i] << ",";
+  }
+  out << "\n};\n";
+  const int unk = vocab.Contains("UNK") ? vocab.Lookup("UNK", 3) : -1;
+  out << "constexpr int kUnk = " << unk << ";\n";
+}
+
+void ModelExporter::Write(ostream& out, const string& model_filename) const {
+  const vector<NativeEvaluator::Layer>& layers = evaluator.layers;
+  const bool bilstm = evaluator.forward_layers.size() > 0;
+  const Matrix fHb = evaluator.fHb, fOb = evaluator.fOb;
+
+  out << "// Generated by export_model from " << model_filename << ". Do not edit.\n";
+  out << "#include <algorithm>\n#include <cmath>\n#include <cstdlib>\n#include <cstring>\n#include <string>\n#include <vector>\n";
+  out << "#include \"exported_model.h\"\n\n";
+  out << "namespace {\n\n";
+  out << "constexpr unsigned kVocabSize = " << vocab.size() << ";\n";
+  out << "constexpr unsigned kWordDim = " << evaluator.embeddings.rows() << ";\n";
+  out << "constexpr unsigned kLeafDim = " << layers[0].x2i.cols() << ";\n";
+  out << "constexpr unsigned kNodeDim = " << layers[0].bi.size() << ";\n";
+  out << "constexpr unsigned kHiddenDim = " << fHb.size() << ";\n";
+  out << "constexpr unsigned kLabelCount = " << fOb.size() << ";\n";
+  out << "constexpr unsigned kLayers = " << layers.size() << ";\n";
+  out << "constexpr unsigned kBranching = " << evaluator.N << ";\n";
+  if (bilstm) {
+    out << "constexpr unsigned kLeafLayers = " << evaluator.forward_layers.size() << ";\n";
+    out << "constexpr unsigned kLeafLSTMDim = " << evaluator.forward_layers[0].h2i.rows() << ";\n";
+  }
+  out << kTypes << "\n";
+
+  WriteVocabulary(out);
+  WriteArray(out, "kEmbeddings", {&evaluator.embeddings});
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    WriteTreeLayer(out, "kTree" + to_string(i), layers[i]);
+  }
+  out << "constexpr TreeLayer kTreeLayers[kLayers] = {\n";
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    const string name = "kTree" + to_string(i);
+    out << "  {" << name << "_x2i, " << name << "_x2f, " << name << "_x2o, " << name << "_x2c, ";
+    out << name << "_bi, " << name << "_bf, " << name << "_bo, " << name << "_bc, ";
+    out << name << "_h2i, " << name << "_h2f, " << name << "_h2o, " << name << "_h2c, ";
+    out << name << "_c2i, " << name << "_c2f, " << name << "_c2o},\n";
+  }
+  out << "};\n";
+
+  if (bilstm) {
+    const vector<NativeEvaluator::LeafLayer>* directions[] = {&evaluator.forward_layers, &evaluator.reverse_layers};
+    const char* direction_names[] = {"kForward", "kReverse"};
+    for (unsigned d = 0; d < 2; ++d) {
+      const vector<NativeEvaluator::LeafLayer>& leaf_layers = *directions[d];
+      for (unsigned i = 0; i < leaf_layers.size(); ++i) {
+        WriteLeafLayer(out, direction_names[d] + to_string(i), leaf_layers[i]);
+      }
+      out << "constexpr LeafLayer " << direction_names[d] << "Layers[kLeafLayers] = {\n";
+      for (unsigned i = 0; i < leaf_layers.size(); ++i) {
+        const string name = direction_names[d] + to_string(i);
+        out << "  {" << name << "_x2ioc, " << name << "_b_ioc, " << name << "_h2i, " << name << "_c2i, ";
+        out << name << "_h2o, " << name << "_c2o, " << name << "_h2c},\n";
+      }
+      out << "};\n";
+    }
+  }
+
+  WriteArray(out, "kFIH", {&evaluator.fIH});
+  WriteArray(out, "kFHb", {&fHb});
+  WriteArray(out, "kFHO", {&evaluator.fHO});
+  WriteArray(out, "kFOb", {&fOb});
+
+  out << (bilstm ? kBiLSTMLeaves : kLookupLeaves);
+  out << kForward;
+}
+
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("model", po::value<string>()->required(), "Model file, as output by train")
+  ("output", po::value<string>()->required(), "C++ source file to write. Compiled with exported_model.h, it needs nothing but the standard library; see the exported target in the Makefile.")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string model_filename = vm["model"].as<string>();
+  const string output_filename = vm["output"].as<string>();
+  cnn::Initialize(argc, argv);
+
+  Vocabulary* vocab = nullptr;
+  Model* cnn_model = nullptr;
+  SentimentModel* sentiment_model = nullptr;
+  tie(vocab, cnn_model, sentiment_model) = LoadModel(model_filename);
+  NativeEvaluator evaluator(*sentiment_model);
+
+  ofstream out(output_filename);
+  ModelExporter(evaluator, *vocab).Write(out, model_filename);
+  out.close();
+  if (!out) {
+    cerr << "ERROR: Unable to write " << output_filename << endl;
+    return 1;
+  }
+  return 0;
+}
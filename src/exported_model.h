@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// The interface of a model compiled to C++ by export_model. The generated
+// source implements it with nothing but the standard library, and holds
+// all of the model's weights as constants, so there is nothing to load.
+namespace exported_model {
+
+struct NodePrediction {
+  unsigned start, end; // Terminals covered by the node, end exclusive
+  unsigned sentiment; // The node's label in the input tree
+  std::vector<float> scores;
+};
+
+// Scores every internal node of a tree in the usual bracketed format, in
+// post-order, as SentimentModel::PredictBatched() does. If given,
+// terminals receives the tree's words as the model sees them, i.e. with
+// unknown words replaced by UNK. Returns false if the tree can't be read,
+// or has an unknown word and the model has no UNK.
+bool Predict(const std::string& tree, std::vector<NodePrediction>* predictions, std::vector<std::string>* terminals = nullptr);
+
+} // namespace exported_model
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exported_model.h"
+
+using namespace std;
+
+// Reads trees from stdin and writes the same output as predict, using a
+// model compiled by export_model rather than cnn
+int main() {
+  string line;
+  unsigned sentence_number = 0;
+  while (getline(cin, line)) {
+    vector<exported_model::NodePrediction> predictions;
+    vector<string> terminals;
+    if (!exported_model::Predict(line, &predictions, &terminals)) {
+      cerr << "Skipping sentence " << sentence_number << ", which can't be read" << endl;
+    }
+
+    for (const exported_model::NodePrediction& prediction : predictions) {
+      unsigned best = 0;
+      for (unsigned i = 1; i < prediction.scores.size(); ++i) {
+        if (prediction.scores[i] > prediction.scores[best]) {
+          best = i;
+        }
+      }
+      cout << sentence_number << " ||| ";
+      for (unsigned i = prediction.start; i < prediction.end; ++i) {
+        cout << terminals[i] << " ";
+      }
+      cout << "||| " << prediction.sentiment << " ||| " << best << " |||";
+      for (float v : prediction.scores) {
+        cout << " " << v;
+      }
+      cout << "\n";
+    }
+
+    sentence_number++;
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include "lazy_trainer.h"
+
+LazyTrainer::LazyTrainer(Model* m, cnn::real lambda, cnn::real eta, unsigned moment_count) : Trainer(m, lambda, eta), step_count(0), moment_count(moment_count) {
+  for (Parameters* p : model->parameters_list()) {
+    dense_moments.push_back(vector<Vector>());
+    Allocate(&dense_moments.back(), p->values.d.size());
+  }
+  for (LookupParameters* p : model->lookup_parameters_list()) {
+    lookup_moments.push_back(vector<vector<Vector>>(p->values.size()));
+    row_steps.push_back(vector<unsigned long>(p->values.size(), 0));
+  }
+}
+
+void LazyTrainer::Allocate(vector<Vector>* moments, unsigned size) const {
+  if (moments->size() == 0) {
+    moments->assign(moment_count, Vector::Zero(size));
+  }
+}
+
+cnn::real LazyTrainer::Decay() const {
+  return 1.0 - eta * lambda;
+}
+
+double LazyTrainer::GeometricSum(double d, double r, unsigned k) {
+  if (k == 0) {
+    return 0.0;
+  }
+  if (fabs(d - r) < 1e-12) {
+    return k * pow(r, k);
+  }
+  return r * (pow(d, k) - pow(r, k)) / (d - r);
+}
+
+void LazyTrainer::update(cnn::real scale) {
+  const cnn::real g_scale = scale * clip_gradients();
+  step_count++;
+
+  const vector<Parameters*>& params = model->parameters_list();
+  for (unsigned i = 0; i < params.size(); ++i) {
+    Parameters* p = params[i];
+    Values w(p->values.v, p->values.d.size());
+    const Vector g = Values(p->g.v, p->g.d.size()) * g_scale;
+    Step(w, g, dense_moments[i]);
+  }
+
+  // Only rows with gradients are updated. Touch() caught them up before
+  // the graph read them, so this is normally a no-op.
+  const vector<LookupParameters*>& lookup_params = model->lookup_parameters_list();
+  for (unsigned i = 0; i < lookup_params.size(); ++i) {
+    LookupParameters* p = lookup_params[i];
+    for (unsigned row : p->non_zero_grads) {
+      CatchUp(i, row, step_count - 1);
+      Values w(p->values[row].v, p->values[row].d.size());
+      const Vector g = Values(p->grads[row].v, p->grads[row].d.size()) * g_scale;
+      vector<Vector>& moments = lookup_moments[i][row];
+      Allocate(&moments, w.size());
+      Step(w, g, moments);
+      row_steps[i][row] = step_count;
+    }
+  }
+
+  ++updates;
+  model->reset_gradient();
+}
+
+void LazyTrainer::CatchUp(unsigned param, unsigned row, unsigned long step) {
+  if (row_steps[param][row] < step) {
+    LookupParameters* p = model->lookup_parameters_list()[param];
+    Values w(p->values[row].v, p->values[row].d.size());
+    Skip(w, lookup_moments[param][row], step - row_steps[param][row]);
+    row_steps[param][row] = step;
+  }
+}
+
+void LazyTrainer::Touch(LookupParameters* p, const vector<unsigned>& rows) {
+  const vector<LookupParameters*>& lookup_params = model->lookup_parameters_list();
+  const unsigned i = find(lookup_params.begin(), lookup_params.end(), p) - lookup_params.begin();
+  assert (i < lookup_params.size());
+  for (unsigned row : rows) {
+    CatchUp(i, row, step_count);
+  }
+}
+
+void LazyTrainer::Flush() {
+  const vector<LookupParameters*>& lookup_params = model->lookup_parameters_list();
+  for (unsigned i = 0; i < lookup_params.size(); ++i) {
+    for (unsigned row = 0; row < lookup_params[i]->values.size(); ++row) {
+      CatchUp(i, row, step_count);
+    }
+  }
+}
+
+LazySGDTrainer::LazySGDTrainer(Model* m, cnn::real lambda, cnn::real eta) : LazyTrainer(m, lambda, eta, 0) {}
+
+void LazySGDTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  w = Decay() * w - eta * g;
+}
+
+void LazySGDTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  w *= pow(Decay(), step_count);
+}
+
+// moments[0] is the velocity v, with v <- momentum v + g and w <- d w - eta v
+LazyMomentumSGDTrainer::LazyMomentumSGDTrainer(Model* m, cnn::real lambda, cnn::real eta, cnn::real momentum) : LazyTrainer(m, lambda, eta, 1), momentum(momentum) {}
+
+void LazyMomentumSGDTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  Vector& v = moments[0];
+  v = momentum * v + g;
+  w = Decay() * w - eta * v;
+}
+
+void LazyMomentumSGDTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  const double d = Decay();
+  w *= pow(d, step_count);
+  if (moments.size() > 0) {
+    Vector& v = moments[0];
+    w -= (eta * GeometricSum(d, momentum, step_count)) * v;
+    v *= pow(momentum, step_count);
+  }
+}
+
+// moments[0] is the sum of squared gradients
+LazyAdagradTrainer::LazyAdagradTrainer(Model* m, cnn::real lambda, cnn::real eta, cnn::real epsilon) : LazyTrainer(m, lambda, eta, 1), epsilon(epsilon) {}
+
+void LazyAdagradTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  Vector& G = moments[0];
+  G += g.cwiseAbs2();
+  w = Decay() * w - eta * (g.array() / (G.array() + epsilon).sqrt()).matrix();
+}
+
+void LazyAdagradTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  w *= pow(Decay(), step_count);
+}
+
+// moments[0] and moments[1] are the running averages of squared gradients
+// and of squared updates. Adadelta has no learning rate, so eta is only
+// used for weight decay.
+LazyAdadeltaTrainer::LazyAdadeltaTrainer(Model* m, cnn::real lambda, cnn::real epsilon, cnn::real rho) : LazyTrainer(m, lambda, 1.0, 2), epsilon(epsilon), rho(rho) {}
+
+void LazyAdadeltaTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  Vector& g2 = moments[0];
+  Vector& delta2 = moments[1];
+  g2 = rho * g2 + (1.0f - rho) * g.cwiseAbs2();
+  const Vector delta = -((delta2.array() + epsilon).sqrt() / (g2.array() + epsilon).sqrt() * g.array()).matrix();
+  delta2 = rho * delta2 + (1.0f - rho) * delta.cwiseAbs2();
+  w = Decay() * w + delta;
+}
+
+void LazyAdadeltaTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  w *= pow(Decay(), step_count);
+  for (Vector& moment : moments) {
+    moment *= pow(rho, step_count);
+  }
+}
+
+// moments[0] is the running average of squared gradients
+LazyRmsPropTrainer::LazyRmsPropTrainer(Model* m, cnn::real lambda, cnn::real eta, cnn::real epsilon, cnn::real rho) : LazyTrainer(m, lambda, eta, 1), epsilon(epsilon), rho(rho) {}
+
+void LazyRmsPropTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  Vector& g2 = moments[0];
+  g2 = rho * g2 + (1.0f - rho) * g.cwiseAbs2();
+  w = Decay() * w - eta * (g.array() / (g2.array() + epsilon).sqrt()).matrix();
+}
+
+void LazyRmsPropTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  w *= pow(Decay(), step_count);
+  if (moments.size() > 0) {
+    moments[0] *= pow(rho, step_count);
+  }
+}
+
+// moments[0] and moments[1] are the first and second moments, m and v
+LazyAdamTrainer::LazyAdamTrainer(Model* m, cnn::real lambda, cnn::real alpha, cnn::real beta_1, cnn::real beta_2, cnn::real epsilon) : LazyTrainer(m, lambda, alpha, 2), beta_1(beta_1), beta_2(beta_2), epsilon(epsilon) {}
+
+void LazyAdamTrainer::Step(Values& w, const Vector& g, vector<Vector>& moments) {
+  Vector& m = moments[0];
+  Vector& v = moments[1];
+  m = beta_1 * m + (1.0f - beta_1) * g;
+  v = beta_2 * v + (1.0f - beta_2) * g.cwiseAbs2();
+  const cnn::real m_correction = 1.0 - pow(beta_1, step_count);
+  const cnn::real v_correction = 1.0 - pow(beta_2, step_count);
+  w = Decay() * w - eta * ((m.array() / m_correction) / ((v.array() / v_correction).sqrt() + epsilon)).matrix();
+}
+
+// Each skipped step j moves w by eta m_j / sqrt(v_j), after bias
+// correction, where m_j = beta_1^j m and v_j = beta_2^j v. That is the
+// current ratio shrinking by beta_1 / sqrt(beta_2) per step.
+void LazyAdamTrainer::Skip(Values& w, vector<Vector>& moments, unsigned step_count) {
+  const double d = Decay();
+  w *= pow(d, step_count);
+  if (moments.size() > 0) {
+    Vector& m = moments[0];
+    Vector& v = moments[1];
+    const cnn::real m_correction = 1.0 - pow(beta_1, this->step_count);
+    const cnn::real v_correction = 1.0 - pow(beta_2, this->step_count);
+    Vector ratio(m.size());
+    for (unsigned k = 0; k < m.size(); ++k) {
+      ratio[k] = (v[k] > 0.0f) ? (m[k] / m_correction) / sqrt(v[k] / v_correction) : 0.0f;
+    }
+    w -= (eta * GeometricSum(d, beta_1 / sqrt(beta_2), step_count)) * ratio;
+    m *= pow(beta_1, step_count);
+    v *= pow(beta_2, step_count);
+  }
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <vector>
+#include <Eigen/Dense>
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+
+using namespace std;
+using namespace cnn;
+
+// Trainers whose cost per update scales with the lookup parameter rows
+// that have gradients (the words in the minibatch, and the child positions
+// it uses), rather than with the vocabulary. Other rows are left alone,
+// and the steps they miss are applied in closed form by Touch(), which
+// must be called for the rows a graph reads before it runs forward, or by
+// Flush(). update() then only applies the current step.
+//
+// To make the missed steps cheap, L2 regularization is applied as
+// decoupled weight decay, multiplying weights by 1 - eta * lambda on
+// every step, rather than being added to the gradient.
+class LazyTrainer : public Trainer {
+public:
+  void update(cnn::real scale) override;
+  // Applies the steps that rows of p have missed, so that a graph reading
+  // them sees the same values an eager trainer would have left
+  void Touch(LookupParameters* p, const vector<unsigned>& rows);
+  // Applies every row's missed steps. Call before the model is evaluated or saved.
+  void Flush();
+
+protected:
+  typedef Eigen::VectorXf Vector;
+  typedef Eigen::Map<Eigen::VectorXf> Values;
+
+  LazyTrainer(Model* m, cnn::real lambda, cnn::real eta, unsigned moment_count);
+  // One step with gradient g, which is already scaled. The moments hold
+  // one vector per element of state, and are zero to begin with.
+  virtual void Step(Values& w, const Vector& g, vector<Vector>& moments) = 0;
+  // step_count steps with zero gradients, ending with the current step.
+  // moments is empty if the row has never had a gradient.
+  virtual void Skip(Values& w, vector<Vector>& moments, unsigned step_count) = 0;
+
+  // The weight decay of one step
+  cnn::real Decay() const;
+  // Sum over j = 1..k of d^(k - j) r^j: the combined effect, after k steps
+  // of decay d, of a term that shrinks by r on each step
+  static double GeometricSum(double d, double r, unsigned k);
+
+  unsigned long step_count;
+
+private:
+  void Allocate(vector<Vector>* moments, unsigned size) const;
+  // Brings row of the param'th lookup parameter up to date with step
+  void CatchUp(unsigned param, unsigned row, unsigned long step);
+
+  const unsigned moment_count;
+  vector<vector<Vector>> dense_moments; // By parameter, then moment
+  vector<vector<vector<Vector>>> lookup_moments; // By parameter, then row, then moment
+  vector<vector<unsigned long>> row_steps; // The step each row is up to date with
+};
+
+struct LazySGDTrainer : public LazyTrainer {
+  explicit LazySGDTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real eta = 0.1);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+};
+
+struct LazyMomentumSGDTrainer : public LazyTrainer {
+  explicit LazyMomentumSGDTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real eta = 0.01, cnn::real momentum = 0.9);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+  const cnn::real momentum;
+};
+
+struct LazyAdagradTrainer : public LazyTrainer {
+  explicit LazyAdagradTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real eta = 0.1, cnn::real epsilon = 1e-20);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+  const cnn::real epsilon;
+};
+
+struct LazyAdadeltaTrainer : public LazyTrainer {
+  explicit LazyAdadeltaTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real epsilon = 1e-6, cnn::real rho = 0.95);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+  const cnn::real epsilon;
+  const cnn::real rho;
+};
+
+struct LazyRmsPropTrainer : public LazyTrainer {
+  explicit LazyRmsPropTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real eta = 0.1, cnn::real epsilon = 1e-20, cnn::real rho = 0.95);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+  const cnn::real epsilon;
+  const cnn::real rho;
+};
+
+// Skipped steps still move a row along its decaying first moment. That
+// drift is applied too, taking epsilon and the bias corrections to be
+// constant over the skipped steps.
+struct LazyAdamTrainer : public LazyTrainer {
+  explicit LazyAdamTrainer(Model* m, cnn::real lambda = 1e-6, cnn::real alpha = 0.001, cnn::real beta_1 = 0.9, cnn::real beta_2 = 0.999, cnn::real epsilon = 1e-8);
+  void Step(Values& w, const Vector& g, vector<Vector>& moments) override;
+  void Skip(Values& w, vector<Vector>& moments, unsigned step_count) override;
+  const cnn::real beta_1;
+  const cnn::real beta_2;
+  const cnn::real epsilon;
+};
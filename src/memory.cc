@@ -0,0 +1,306 @@
+#include <cassert>
+#include <climits>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include "cnn/tensor.h"
+#include "memory.h"
+
+OversizePolicy ParseOversizePolicy(const string& name) {
+  if (name == "skip") {
+    return SKIP_OVERSIZE;
+  }
+  else if (name == "split") {
+    return SPLIT_OVERSIZE;
+  }
+  else if (name == "stream") {
+    return STREAM_OVERSIZE;
+  }
+  else if (name == "checkpoint") {
+    return CHECKPOINT_OVERSIZE;
+  }
+  cerr << "Invalid oversize policy \"" << name << "\". Please use skip, split, stream, or checkpoint." << endl;
+  exit(1);
+}
+
+bool SupportsOversizePolicy(const TreeLimits& limits, const SentimentModel& model) {
+  return limits.policy == SKIP_OVERSIZE || !model.HasContextualLeaves();
+}
+
+unsigned MaxTreeNodes(const TreeLimits& limits, const SentimentModel& model) {
+  unsigned max_nodes = (limits.max_nodes > 0) ? limits.max_nodes : UINT_MAX;
+  if (limits.max_graph_bytes > 0) {
+    const size_t fixed_bytes = model.EstimateGraphBytes(0);
+    const size_t per_node_bytes = model.EstimateGraphBytes(1) - fixed_bytes;
+    size_t n = (limits.max_graph_bytes > fixed_bytes) ? (limits.max_graph_bytes - fixed_bytes) / per_node_bytes : 0;
+    max_nodes = min((size_t)max_nodes, n);
+  }
+  // A chunk needs room for at least one internal node and its children
+  return max(max_nodes, 2U);
+}
+
+size_t GraphBytesInUse() {
+  return cnn::fxs->used + cnn::dEdfs->used;
+}
+
+size_t ParameterBytes(const Model& model) {
+  size_t bytes = 0;
+  for (const Parameters* p : model.parameters_list()) {
+    bytes += p->size();
+  }
+  for (const LookupParameters* p : model.lookup_parameters_list()) {
+    bytes += p->size();
+  }
+  // Values and gradients
+  return 2 * sizeof(cnn::real) * bytes;
+}
+
+size_t OptimizerBytes(const Model& model, const Trainer* trainer) {
+  // Number of parameter-sized vectors each optimizer keeps
+  unsigned copies = 0;
+  if (dynamic_cast<const MomentumSGDTrainer*>(trainer) != nullptr) {
+    copies = 1;
+  }
+  else if (dynamic_cast<const AdagradTrainer*>(trainer) != nullptr) {
+    copies = 1;
+  }
+  else if (dynamic_cast<const AdadeltaTrainer*>(trainer) != nullptr) {
+    copies = 2;
+  }
+  else if (dynamic_cast<const RmsPropTrainer*>(trainer) != nullptr) {
+    copies = 1;
+  }
+  else if (dynamic_cast<const AdamTrainer*>(trainer) != nullptr) {
+    copies = 2;
+  }
+  return copies * ParameterBytes(model) / 2;
+}
+
+GraphMemoryMonitor::GraphMemoryMonitor() : last_bytes_(0), peak_bytes_(0), high_water_bytes_(0) {}
+
+void GraphMemoryMonitor::Observe() {
+  last_bytes_ = GraphBytesInUse();
+  peak_bytes_ = max(peak_bytes_, last_bytes_);
+  high_water_bytes_ = max(high_water_bytes_, last_bytes_);
+}
+
+void GraphMemoryMonitor::ResetPeak() {
+  peak_bytes_ = 0;
+}
+
+size_t GraphMemoryMonitor::last_bytes() const {
+  return last_bytes_;
+}
+
+size_t GraphMemoryMonitor::peak_bytes() const {
+  return peak_bytes_;
+}
+
+size_t GraphMemoryMonitor::high_water_bytes() const {
+  return high_water_bytes_;
+}
+
+size_t GraphMemoryMonitor::capacity_bytes() const {
+  return cnn::fxs->capacity + cnn::dEdfs->capacity;
+}
+
+string FormatBytes(size_t bytes) {
+  stringstream ss;
+  ss << fixed << setprecision(1) << bytes / (1024.0 * 1024.0) << " MB";
+  return ss.str();
+}
+
+// Returns the number of nodes in tree's subtree that are not yet part of a chunk
+static unsigned PartitionTree(const SyntaxTree& tree, unsigned max_nodes, vector<const SyntaxTree*>* roots) {
+  vector<unsigned> open_sizes(tree.NumChildren());
+  unsigned open_size = 1;
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    open_sizes[i] = PartitionTree(tree.GetChild(i), max_nodes, roots);
+    open_size += open_sizes[i];
+  }
+
+  // Close off the largest children as chunks of their own until we fit
+  while (open_size > max_nodes) {
+    unsigned largest = max_element(open_sizes.begin(), open_sizes.end()) - open_sizes.begin();
+    if (largest >= open_sizes.size() || open_sizes[largest] == 0) {
+      break;
+    }
+    roots->push_back(&tree.GetChild(largest));
+    open_size -= open_sizes[largest];
+    open_sizes[largest] = 0;
+  }
+  return open_size;
+}
+
+vector<const SyntaxTree*> PartitionTree(const SyntaxTree& tree, unsigned max_nodes) {
+  vector<const SyntaxTree*> roots;
+  PartitionTree(tree, max_nodes, &roots);
+  roots.push_back(&tree);
+  return roots;
+}
+
+static void SplitTree(const SyntaxTree& tree, unsigned max_nodes, vector<const SyntaxTree*>* pieces) {
+  if (tree.NumNodes() <= max_nodes) {
+    pieces->push_back(&tree);
+  }
+  else {
+    for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+      SplitTree(tree.GetChild(i), max_nodes, pieces);
+    }
+  }
+}
+
+vector<const SyntaxTree*> SplitTree(const SyntaxTree& tree, unsigned max_nodes) {
+  vector<const SyntaxTree*> pieces;
+  SplitTree(tree, max_nodes, &pieces);
+  return pieces;
+}
+
+// Runs every chunk of tree through its own graph, collecting each node's
+// output distribution if results is not null, and the state of each chunk's
+// root in states. Returns the total loss, times weight.
+static cnn::real RunChunks(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, bool backward, GraphMemoryMonitor* monitor, const vector<bool>* selected_nodes, vector<tuple<SyntaxTree*, vector<cnn::real>>>* results, map<unsigned, NodeState>& states, cnn::real weight = 1.0) {
+  cnn::real loss = 0.0;
+  for (const SyntaxTree* chunk : PartitionTree(tree, max_nodes)) {
+    ComputationGraph cg;
+    vector<SyntaxTree*> nodes;
+    Expression outputs = model.PredictBatched(*chunk, cg, &nodes, &states, selected_nodes);
+    if (nodes.size() > 0) {
+      model.CalculateBatchedLoss(nodes, outputs, cg, vector<cnn::real>(weight != 1.0 ? nodes.size() : 0, weight));
+      loss += as_scalar(cg.forward());
+      if (backward) {
+        cg.backward();
+      }
+    }
+    else {
+      cg.forward();
+    }
+
+    if (monitor != nullptr) {
+      monitor->Observe();
+    }
+
+    if (results != nullptr && nodes.size() > 0) {
+      vector<vector<cnn::real>> columns = ReadColumns(outputs);
+      for (unsigned i = 0; i < nodes.size(); ++i) {
+        results->push_back(make_tuple(nodes[i], columns[i]));
+      }
+    }
+    states[chunk->id()] = model.GetNodeState(chunk->id());
+  }
+  return loss;
+}
+
+vector<tuple<SyntaxTree*, vector<cnn::real>>> PredictStreaming(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, GraphMemoryMonitor* monitor, const vector<bool>* selected_nodes) {
+  vector<tuple<SyntaxTree*, vector<cnn::real>>> results;
+  map<unsigned, NodeState> states;
+  RunChunks(model, tree, max_nodes, false, monitor, selected_nodes, &results, states);
+
+  // Node ids are assigned in post-order, so this matches the order of Predict()
+  sort(results.begin(), results.end(), [](const tuple<SyntaxTree*, vector<cnn::real>>& a, const tuple<SyntaxTree*, vector<cnn::real>>& b) {
+    return get<0>(a)->id() < get<0>(b)->id();
+  });
+  return results;
+}
+
+cnn::real StreamingLoss(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, bool backward, GraphMemoryMonitor* monitor, cnn::real weight) {
+  map<unsigned, NodeState> states;
+  return RunChunks(model, tree, max_nodes, backward, monitor, nullptr, nullptr, states, weight);
+}
+
+// Parameters standing in for chunk boundary states during CheckpointedLoss().
+// They live in a model of their own, which no trainer ever sees, and are
+// reused from one chunk to the next since cnn can't free parameters.
+static Parameters* BoundaryParameters(unsigned index, unsigned dim) {
+  static Model boundary_model;
+  static map<pair<unsigned, unsigned>, Parameters*> boundary_params;
+  Parameters*& p = boundary_params[make_pair(dim, index)];
+  if (p == nullptr) {
+    p = boundary_model.add_parameters({(long)dim});
+  }
+  return p;
+}
+
+// Finds the roots of the chunks directly below node
+static void FindBoundaries(const SyntaxTree& node, const map<unsigned, NodeState>& states, vector<unsigned>* boundaries) {
+  for (unsigned i = 0; i < node.NumChildren(); ++i) {
+    const SyntaxTree& child = node.GetChild(i);
+    if (states.count(child.id()) > 0) {
+      boundaries->push_back(child.id());
+    }
+    else {
+      FindBoundaries(child, states, boundaries);
+    }
+  }
+}
+
+cnn::real CheckpointedLoss(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, bool backward, GraphMemoryMonitor* monitor, cnn::real weight) {
+  map<unsigned, NodeState> states;
+  cnn::real loss = RunChunks(model, tree, max_nodes, false, monitor, nullptr, nullptr, states, weight);
+  if (!backward) {
+    return loss;
+  }
+
+  // The gradient of the loss with respect to each chunk root's h and c, per layer
+  map<unsigned, NodeState> root_gradients;
+  vector<const SyntaxTree*> chunks = PartitionTree(tree, max_nodes);
+  for (auto it = chunks.rbegin(); it != chunks.rend(); ++it) {
+    const SyntaxTree* chunk = *it;
+    vector<unsigned> boundaries;
+    FindBoundaries(*chunk, states, &boundaries);
+
+    map<unsigned, NodeState> fixed_states;
+    unsigned param_count = 0;
+    for (unsigned id : boundaries) {
+      NodeState& state = fixed_states[id];
+      state = states[id];
+      for (unsigned j = 0; j < state.h.size(); ++j) {
+        state.h_params.push_back(BoundaryParameters(param_count++, state.h[j].size()));
+        state.c_params.push_back(BoundaryParameters(param_count++, state.c[j].size()));
+        TensorTools::SetElements(state.h_params[j]->values, state.h[j]);
+        TensorTools::SetElements(state.c_params[j]->values, state.c[j]);
+        state.h_params[j]->clear();
+        state.c_params[j]->clear();
+      }
+    }
+
+    ComputationGraph cg;
+    vector<SyntaxTree*> nodes;
+    Expression outputs = model.PredictBatched(*chunk, cg, &nodes, &fixed_states);
+    vector<Expression> terms;
+    if (nodes.size() > 0) {
+      terms.push_back(model.CalculateBatchedLoss(nodes, outputs, cg, vector<cnn::real>(weight != 1.0 ? nodes.size() : 0, weight)));
+    }
+    // Backpropagating the dot product of the root's state and the gradient
+    // from above passes that gradient on unchanged
+    if (root_gradients.count(chunk->id()) > 0) {
+      const NodeState& gradient = root_gradients[chunk->id()];
+      vector<Expression> h, c;
+      model.GetNodeStateExpressions(chunk->id(), &h, &c);
+      for (unsigned j = 0; j < h.size(); ++j) {
+        terms.push_back(dot_product(input(cg, {(long)gradient.h[j].size()}, &gradient.h[j]), h[j]));
+        terms.push_back(dot_product(input(cg, {(long)gradient.c[j].size()}, &gradient.c[j]), c[j]));
+      }
+    }
+    if (terms.size() > 0) {
+      sum(terms);
+      cg.forward();
+      cg.backward();
+    }
+    if (monitor != nullptr) {
+      monitor->Observe();
+    }
+
+    for (unsigned id : boundaries) {
+      const NodeState& state = fixed_states[id];
+      NodeState& gradient = root_gradients[id];
+      for (unsigned j = 0; j < state.h_params.size(); ++j) {
+        gradient.h.push_back(as_vector(state.h_params[j]->g));
+        gradient.c.push_back(as_vector(state.c_params[j]->g));
+      }
+    }
+    root_gradients.erase(chunk->id());
+  }
+  return loss;
+}
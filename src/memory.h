@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <tuple>
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+#include "sentiment.h"
+#include "syntax_tree.h"
+
+using namespace std;
+using namespace cnn;
+
+// What to do with a tree whose graph would exceed the configured limits
+enum OversizePolicy {
+  SKIP_OVERSIZE,   // Leave the tree out entirely
+  SPLIT_OVERSIZE,  // Use its largest constituents that fit as separate trees
+  STREAM_OVERSIZE, // Evaluate it in bounded chunks, passing states upwards
+  CHECKPOINT_OVERSIZE, // As above, recomputing chunks to pass gradients back down
+};
+
+struct TreeLimits {
+  unsigned max_nodes = 0; // 0 means no limit
+  size_t max_graph_bytes = 0; // 0 means no limit
+  OversizePolicy policy = SKIP_OVERSIZE;
+};
+
+OversizePolicy ParseOversizePolicy(const string& name);
+
+// Whether model gives the same results under limits' policy as on whole
+// trees. Split, stream and checkpoint evaluate a tree in pieces, so they
+// don't work with contextual leaves, which have to see the whole sentence.
+bool SupportsOversizePolicy(const TreeLimits& limits, const SentimentModel& model);
+
+// The largest number of nodes a tree may have and still satisfy limits,
+// or UINT_MAX if there is no limit.
+unsigned MaxTreeNodes(const TreeLimits& limits, const SentimentModel& model);
+
+// Bytes currently allocated from cnn's forward and backward memory pools
+size_t GraphBytesInUse();
+// Bytes of parameter values and gradients
+size_t ParameterBytes(const Model& model);
+// Bytes of per-parameter state kept by the optimizer (e.g. momentum)
+size_t OptimizerBytes(const Model& model, const Trainer* trainer);
+
+// Tracks how much of cnn's graph memory each tree uses
+class GraphMemoryMonitor {
+public:
+  GraphMemoryMonitor();
+  // Call after running forward (and backward) but before cg goes out of scope
+  void Observe();
+  void ResetPeak();
+
+  size_t last_bytes() const;
+  size_t peak_bytes() const; // Largest single tree since the last ResetPeak()
+  size_t high_water_bytes() const; // Largest single tree ever
+  size_t capacity_bytes() const;
+private:
+  size_t last_bytes_;
+  size_t peak_bytes_;
+  size_t high_water_bytes_;
+};
+
+string FormatBytes(size_t bytes);
+
+// Splits tree into chunks of at most max_nodes nodes each, not counting
+// nodes in other chunks. Returns the root of each chunk, such that every
+// chunk comes after all the chunks nested inside it. The last is tree itself.
+vector<const SyntaxTree*> PartitionTree(const SyntaxTree& tree, unsigned max_nodes);
+
+// Returns the largest disjoint constituents of tree with at most max_nodes nodes
+vector<const SyntaxTree*> SplitTree(const SyntaxTree& tree, unsigned max_nodes);
+
+// Evaluate tree one chunk at a time, so that no graph ever holds more than
+// about max_nodes nodes. Each chunk sees the states of the chunks below it
+// as constants, so predictions are exact but gradients are truncated at
+// chunk boundaries. Like SplitTree(), these need a model whose leaves don't
+// read the rest of the sentence (see SupportsOversizePolicy()).
+vector<tuple<SyntaxTree*, vector<cnn::real>>> PredictStreaming(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, GraphMemoryMonitor* monitor, const vector<bool>* selected_nodes = nullptr);
+// Losses are multiplied by weight, as in SentimentModel::BuildGraph().
+cnn::real StreamingLoss(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, bool backward, GraphMemoryMonitor* monitor, cnn::real weight = 1.0);
+
+// Like StreamingLoss(), but with exact gradients. Only the states at chunk
+// boundaries are kept from a first forward pass. Each chunk is then rebuilt,
+// from the root down, and backpropagated along with the gradient that
+// reached its root from the chunks above. This costs about one extra
+// forward pass, while no graph ever holds more than one chunk.
+cnn::real CheckpointedLoss(SentimentModel& model, const SyntaxTree& tree, unsigned max_nodes, bool backward, GraphMemoryMonitor* monitor, cnn::real weight = 1.0);
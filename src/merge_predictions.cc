@@ -0,0 +1,103 @@
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+namespace po = boost::program_options;
+
+// One shard's output from predict --shard, as described by its sidecar
+struct Shard {
+  string filename;
+  unsigned index;
+  unsigned count;
+  unsigned sentence_count;
+};
+
+int main(int argc, char** argv) {
+  po::options_description desc("description");
+  desc.add_options()
+  ("shards", po::value<vector<string>>()->multitoken()->required(), "Output files written by predict --shard, in any order. Every shard must be present and complete.")
+  ("output", po::value<string>(), "File to write the merged predictions to, instead of stdout")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("shards", -1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  // Each sidecar is only written once its shard is finished
+  vector<Shard> shards;
+  for (const string& filename : vm["shards"].as<vector<string>>()) {
+    Shard shard;
+    shard.filename = filename;
+    ifstream index(filename + ".idx");
+    if (!(index >> shard.index >> shard.count >> shard.sentence_count)) {
+      cerr << "ERROR: Unable to read " << filename << ".idx. Is the shard unfinished?" << endl;
+      return 1;
+    }
+    shards.push_back(shard);
+  }
+  sort(shards.begin(), shards.end(), [](const Shard& a, const Shard& b) { return a.index < b.index; });
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    if (shards[i].count != shards.size() || shards[i].index != i) {
+      cerr << "ERROR: Expected shards 0 to " << shards.size() - 1 << " of " << shards.size() << ", but " << shards[i].filename << " is shard " << shards[i].index << " of " << shards[i].count << endl;
+      return 1;
+    }
+  }
+
+  ofstream output_file;
+  if (vm.count("output")) {
+    output_file.open(vm["output"].as<string>());
+    if (!output_file.is_open()) {
+      cerr << "ERROR: Unable to write " << vm["output"].as<string>() << endl;
+      return 1;
+    }
+  }
+  ostream& out = output_file.is_open() ? output_file : cout;
+
+  // Shards number their sentences from zero, so each is offset by the
+  // number of sentences in the shards before it
+  unsigned offset = 0;
+  for (const Shard& shard : shards) {
+    ifstream in(shard.filename);
+    if (!in.is_open()) {
+      cerr << "ERROR: Unable to read " << shard.filename << endl;
+      return 1;
+    }
+    for (string line; getline(in, line);) {
+      const size_t end = line.find(' ');
+      unsigned sentence_number = 0;
+      try {
+        sentence_number = stoul(line.substr(0, end));
+      }
+      catch (const exception&) {
+        sentence_number = shard.sentence_count;
+      }
+      if (end == string::npos || sentence_number >= shard.sentence_count) {
+        cerr << "ERROR: Unexpected line in " << shard.filename << ": " << line << endl;
+        return 1;
+      }
+      out << offset + sentence_number << line.substr(end) << "\n";
+    }
+    offset += shard.sentence_count;
+  }
+
+  out.flush();
+  if (!out) {
+    cerr << "ERROR: Unable to write the merged predictions" << endl;
+    return 1;
+  }
+  return 0;
+}
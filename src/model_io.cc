@@ -0,0 +1,44 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <boost/archive/text_iarchive.hpp>
+#include "model_io.h"
+
+tuple<Vocabulary*, Model*, SentimentModel*> ReadModel(const string& model_filename) {
+  ifstream model_file(model_filename);
+  if (!model_file.is_open()) {
+    throw runtime_error("Unable to open " + model_filename);
+  }
+  unique_ptr<Vocabulary> vocab(new Vocabulary());
+  unique_ptr<Model> cnn_model(new Model());
+  unique_ptr<SentimentModel> sentiment_model(new SentimentModel());
+  try {
+    boost::archive::text_iarchive ia(model_file);
+    ia & *vocab;
+    if (vocab->Contains("UNK")) {
+      vocab->SetUnk("UNK");
+    }
+    vocab->Freeze();
+
+    ia & *sentiment_model;
+    sentiment_model->InitializeParameters(*cnn_model, vocab->size());
+
+    ia & *cnn_model;
+  }
+  catch (const exception& e) {
+    throw runtime_error("Unable to read " + model_filename + ", which is not a valid model file: " + e.what());
+  }
+
+  return make_tuple(vocab.release(), cnn_model.release(), sentiment_model.release());
+}
+
+tuple<Vocabulary*, Model*, SentimentModel*> LoadModel(const string& model_filename) {
+  try {
+    return ReadModel(model_filename);
+  }
+  catch (const runtime_error& e) {
+    cerr << "ERROR: " << e.what() << endl;
+    exit(1);
+  }
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <tuple>
+#include "cnn/cnn.h"
+#include "sentiment.h"
+#include "vocabulary.h"
+
+using namespace std;
+using namespace cnn;
+
+// Reads a model file as written by train. The returned vocabulary is frozen,
+// mapping unknown words to UNK if the model has it. Throws runtime_error
+// if the file can't be opened or isn't a valid model file.
+tuple<Vocabulary*, Model*, SentimentModel*> ReadModel(const string& model_filename);
+// The same, but reports the error and exits
+tuple<Vocabulary*, Model*, SentimentModel*> LoadModel(const string& model_filename);
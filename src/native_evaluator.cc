@@ -0,0 +1,364 @@
+#include <cassert>
+#include <atomic>
+#include <memory>
+#include "native_evaluator.h"
+
+static Eigen::MatrixXf Copy(const Tensor& t) {
+  return *t;
+}
+
+static Eigen::VectorXf CopyVector(const Tensor& t) {
+  return (*t).col(0);
+}
+
+static vector<Eigen::MatrixXf> Copy(const LookupParameters* p) {
+  vector<Eigen::MatrixXf> matrices;
+  for (const Tensor& t : p->values) {
+    matrices.push_back(*t);
+  }
+  return matrices;
+}
+
+static Eigen::VectorXf Logistic(const Eigen::VectorXf& x) {
+  return (1.0f / (1.0f + (-x.array()).exp())).matrix();
+}
+
+static Eigen::VectorXf Tanh(const Eigen::VectorXf& x) {
+  return x.array().tanh().matrix();
+}
+
+vector<NativeEvaluator::LeafLayer> NativeEvaluator::CopyLeafLayers(const LSTMBuilder& builder) {
+  // The order of LSTMBuilder's parameters within a layer
+  enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC };
+  vector<LeafLayer> leaf_layers;
+  for (const vector<Parameters*>& p : builder.params) {
+    LeafLayer layer;
+    const Matrix x2i = Copy(p[X2I]->values);
+    const Matrix x2o = Copy(p[X2O]->values);
+    const Matrix x2c = Copy(p[X2C]->values);
+    layer.x2ioc.resize(3 * x2i.rows(), x2i.cols());
+    layer.x2ioc << x2i, x2o, x2c;
+    layer.b_ioc.resize(3 * x2i.rows());
+    layer.b_ioc << CopyVector(p[BI]->values), CopyVector(p[BO]->values), CopyVector(p[BC]->values);
+    layer.h2i = Copy(p[H2I]->values);
+    layer.c2i = Copy(p[C2I]->values);
+    layer.h2o = Copy(p[H2O]->values);
+    layer.c2o = Copy(p[C2O]->values);
+    layer.h2c = Copy(p[H2C]->values);
+    leaf_layers.push_back(layer);
+  }
+  return leaf_layers;
+}
+
+NativeEvaluator::NativeEvaluator(const SentimentModel& model, bool leaf_table) : N(model.max_branching_factor) {
+  const TreeLSTMBuilder& builder = model.tree_builder;
+  for (unsigned i = 0; i < builder.layers; ++i) {
+    const vector<Parameters*>& p = builder.params[i];
+    const vector<LookupParameters*>& lp = builder.lparams[i];
+    Layer layer;
+    layer.x2i = Copy(p[TreeLSTMBuilder::X2I]->values);
+    layer.x2f = Copy(p[TreeLSTMBuilder::X2F]->values);
+    layer.x2o = Copy(p[TreeLSTMBuilder::X2O]->values);
+    layer.x2c = Copy(p[TreeLSTMBuilder::X2C]->values);
+    layer.bi = CopyVector(p[TreeLSTMBuilder::BI]->values);
+    layer.bf = CopyVector(p[TreeLSTMBuilder::BF]->values);
+    layer.bo = CopyVector(p[TreeLSTMBuilder::BO]->values);
+    layer.bc = CopyVector(p[TreeLSTMBuilder::BC]->values);
+    layer.h2i = Copy(lp[TreeLSTMBuilder::H2I]);
+    layer.h2f = Copy(lp[TreeLSTMBuilder::H2F]);
+    layer.h2o = Copy(lp[TreeLSTMBuilder::H2O]);
+    layer.h2c = Copy(lp[TreeLSTMBuilder::H2C]);
+    layer.c2i = Copy(lp[TreeLSTMBuilder::C2I]);
+    layer.c2f = Copy(lp[TreeLSTMBuilder::C2F]);
+    layer.c2o = Copy(lp[TreeLSTMBuilder::C2O]);
+    layers.push_back(layer);
+  }
+
+  embeddings.resize(model.word_embedding_dim, model.p_E->values.size());
+  for (unsigned i = 0; i < model.p_E->values.size(); ++i) {
+    embeddings.col(i) = CopyVector(model.p_E->values[i]);
+  }
+
+  if (model.leaf_encoder == BILSTM_LEAVES) {
+    forward_layers = CopyLeafLayers(model.forward_builder);
+    reverse_layers = CopyLeafLayers(model.reverse_builder);
+  }
+
+  if (leaf_table && forward_layers.size() == 0) {
+    BuildLeafTable();
+  }
+
+  fIH = Copy(model.p_fIH->values);
+  fHb = CopyVector(model.p_fHb->values);
+  fHO = Copy(model.p_fHO->values);
+  fOb = CopyVector(model.p_fOb->values);
+}
+
+// Runs one direction of the leaf BiLSTM over a sentence whose embeddings
+// are the columns of inputs, returning the top layer's output for each.
+// This mirrors RunBatchedLSTM() in sentiment.cc.
+NativeEvaluator::Matrix NativeEvaluator::RunLeafLSTM(const vector<LeafLayer>& layers, Matrix inputs, bool reverse) {
+  const unsigned length = inputs.cols();
+  for (const LeafLayer& layer : layers) {
+    const unsigned dim = layer.h2i.rows();
+    Matrix projected = layer.x2ioc * inputs;
+    projected.colwise() += layer.b_ioc;
+    Matrix outputs(dim, length);
+    Vector h, c;
+    for (unsigned k = 0; k < length; ++k) {
+      const unsigned t = reverse ? length - 1 - k : k;
+      Vector a_i = projected.col(t).segment(0, dim);
+      Vector a_o = projected.col(t).segment(dim, dim);
+      Vector a_w = projected.col(t).segment(2 * dim, dim);
+      if (k > 0) {
+        a_i.noalias() += layer.h2i * h;
+        a_i.noalias() += layer.c2i * c;
+        a_w.noalias() += layer.h2c * h;
+        a_o.noalias() += layer.h2o * h;
+      }
+      const Vector i_t = Logistic(a_i);
+      if (k > 0) {
+        c = (1.0f - i_t.array()).matrix().cwiseProduct(c) + i_t.cwiseProduct(Tanh(a_w));
+      }
+      else {
+        c = i_t.cwiseProduct(Tanh(a_w));
+      }
+      a_o.noalias() += layer.c2o * c;
+      h = Logistic(a_o).cwiseProduct(Tanh(c));
+      outputs.col(t) = h;
+    }
+    inputs = outputs;
+  }
+  return inputs;
+}
+
+// Fills in values.leaves, given every node of the tree indexed by id
+void NativeEvaluator::EncodeLeaves(const vector<const SyntaxTree*>& nodes, TreeValues& values, WorkStealingPool* pool) const {
+  // Ids are assigned in post-order, so terminals come left to right
+  vector<WordId> words;
+  values.leaf_columns.resize(nodes.size());
+  for (unsigned id = 0; id < nodes.size(); ++id) {
+    if (nodes[id] != nullptr && nodes[id]->IsTerminal()) {
+      values.leaf_columns[id] = words.size();
+      words.push_back(nodes[id]->label());
+    }
+  }
+  Matrix inputs(embeddings.rows(), words.size());
+  for (unsigned t = 0; t < words.size(); ++t) {
+    inputs.col(t) = embeddings.col(words[t]);
+  }
+
+  Matrix forward, reverse;
+  vector<WorkStealingPool::Task> tasks = {
+    [&] { forward = RunLeafLSTM(forward_layers, inputs, false); },
+    [&] { reverse = RunLeafLSTM(reverse_layers, inputs, true); },
+  };
+  if (pool != nullptr && pool->size() > 1) {
+    pool->Run(tasks);
+  }
+  else {
+    for (const WorkStealingPool::Task& task : tasks) {
+      task();
+    }
+  }
+  values.leaves.resize(forward.rows() + reverse.rows(), words.size());
+  values.leaves << forward, reverse;
+}
+
+// A leaf has no children, so its state depends only on its word. Each
+// layer is computed for every word at once, as EvaluateNode() would for a
+// single leaf, with no forget gates or recurrent terms.
+void NativeEvaluator::BuildLeafTable() {
+  leaf_h.reserve(layers.size());
+  leaf_c.reserve(layers.size());
+  const Matrix* inputs = &embeddings;
+  for (const Layer& layer : layers) {
+    Matrix a_i = layer.x2i * *inputs;
+    Matrix a_o = layer.x2o * *inputs;
+    Matrix a_w = layer.x2c * *inputs;
+    a_i.colwise() += layer.bi;
+    a_o.colwise() += layer.bo;
+    a_w.colwise() += layer.bc;
+    const Matrix c = (1.0f / (1.0f + (-a_i.array()).exp()) * a_w.array().tanh()).matrix();
+    const Matrix h = (1.0f / (1.0f + (-a_o.array()).exp()) * c.array().tanh()).matrix();
+    leaf_c.push_back(c);
+    leaf_h.push_back(h);
+    inputs = &leaf_h.back();
+  }
+}
+
+// Computes one node's state and output from its children's states.
+// This mirrors TreeLSTMBuilder::add_input() and MLP::FeedBatch().
+void NativeEvaluator::EvaluateNode(const SyntaxTree& node, TreeValues& values) const {
+  const unsigned id = node.id();
+  const unsigned child_count = node.NumChildren();
+  vector<Vector>& h = values.h[id];
+  vector<Vector>& c = values.c[id];
+  h.resize(layers.size());
+  c.resize(layers.size());
+  if (child_count == 0 && leaf_h.size() > 0) {
+    for (unsigned i = 0; i < layers.size(); ++i) {
+      h[i] = leaf_h[i].col(node.label());
+      c[i] = leaf_c[i].col(node.label());
+    }
+    return;
+  }
+
+  Vector embedding;
+  for (unsigned i = 0; i < layers.size(); ++i) {
+    const Layer& layer = layers[i];
+    Vector a_i = layer.bi;
+    Vector a_o = layer.bo;
+    Vector a_w = layer.bc;
+    Vector f_base = layer.bf;
+    // Internal nodes feed zeros into the first layer, so skip those products
+    const Vector* in = nullptr;
+    if (i > 0) {
+      in = &h[i - 1];
+    }
+    else if (child_count == 0) {
+      if (values.leaves.cols() > 0) {
+        embedding = values.leaves.col(values.leaf_columns[id]);
+      }
+      else {
+        embedding = embeddings.col(node.label());
+      }
+      in = &embedding;
+    }
+    if (in != nullptr) {
+      a_i.noalias() += layer.x2i * *in;
+      a_o.noalias() += layer.x2o * *in;
+      a_w.noalias() += layer.x2c * *in;
+      f_base.noalias() += layer.x2f * *in;
+    }
+    for (unsigned j = 0; j < child_count; ++j) {
+      const unsigned ej = (j < N) ? j : N - 1;
+      const Vector& h_j = values.h[node.GetChild(j).id()][i];
+      const Vector& c_j = values.c[node.GetChild(j).id()][i];
+      a_i.noalias() += layer.h2i[ej] * h_j;
+      a_i.noalias() += layer.c2i[ej] * c_j;
+      a_o.noalias() += layer.h2o[ej] * h_j;
+      a_o.noalias() += layer.c2o[ej] * c_j;
+      a_w.noalias() += layer.h2c[ej] * h_j;
+    }
+
+    c[i] = Logistic(a_i).cwiseProduct(Tanh(a_w));
+    for (unsigned k = 0; k < child_count; ++k) {
+      const unsigned ek = (k < N) ? k : N - 1;
+      Vector a_f = f_base;
+      for (unsigned j = 0; j < child_count; ++j) {
+        const unsigned ej = (j < N) ? j : N - 1;
+        a_f.noalias() += layer.h2f[ej * N + ek] * values.h[node.GetChild(j).id()][i];
+        a_f.noalias() += layer.c2f[ej * N + ek] * values.c[node.GetChild(j).id()][i];
+      }
+      c[i] += Logistic(a_f).cwiseProduct(values.c[node.GetChild(k).id()][i]);
+    }
+    h[i] = Logistic(a_o).cwiseProduct(Tanh(c[i]));
+  }
+
+  if (child_count > 0 && (values.selected_nodes == nullptr || (*values.selected_nodes)[id])) {
+    Vector hidden = Tanh(fIH * h.back() + fHb);
+    Vector scores = fHO * hidden + fOb;
+    values.outputs[id].assign(scores.data(), scores.data() + scores.size());
+  }
+}
+
+// Evaluates every node of tree on the calling thread, in post-order
+void NativeEvaluator::EvaluateSubtree(const SyntaxTree& tree, TreeValues& values) const {
+  vector<const SyntaxTree*> node_stack = {&tree};
+  vector<unsigned> index_stack = {0};
+  while (node_stack.size() > 0) {
+    const SyntaxTree* node = node_stack.back();
+    unsigned i = index_stack.back();
+    if (i < node->NumChildren()) {
+      index_stack.back()++;
+      node_stack.push_back(&node->GetChild(i));
+      index_stack.push_back(0);
+    }
+    else {
+      EvaluateNode(*node, values);
+      node_stack.pop_back();
+      index_stack.pop_back();
+    }
+  }
+}
+
+// Finds each node, its parent and its subtree's size, all indexed by id
+static unsigned IndexTree(const SyntaxTree& tree, const SyntaxTree* parent, vector<const SyntaxTree*>* nodes, vector<const SyntaxTree*>* parents, vector<unsigned>* sizes) {
+  unsigned size = 1;
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    size += IndexTree(tree.GetChild(i), &tree, nodes, parents, sizes);
+  }
+  (*nodes)[tree.id()] = &tree;
+  (*parents)[tree.id()] = parent;
+  (*sizes)[tree.id()] = size;
+  return size;
+}
+
+vector<tuple<SyntaxTree*, vector<cnn::real>>> NativeEvaluator::Predict(const SyntaxTree& tree, const vector<bool>* selected_nodes, WorkStealingPool* pool, unsigned min_task_nodes) const {
+  const unsigned id_count = tree.id() + 1;
+  TreeValues values;
+  values.h.resize(id_count);
+  values.c.resize(id_count);
+  values.outputs.resize(id_count);
+  values.selected_nodes = selected_nodes;
+
+  vector<const SyntaxTree*> nodes(id_count);
+  vector<const SyntaxTree*> parents(id_count);
+  vector<unsigned> sizes(id_count);
+  IndexTree(tree, nullptr, &nodes, &parents, &sizes);
+  if (forward_layers.size() > 0) {
+    EncodeLeaves(nodes, values, pool);
+  }
+
+  if (pool == nullptr || pool->size() == 1 || sizes[tree.id()] <= min_task_nodes) {
+    EvaluateSubtree(tree, values);
+  }
+  else {
+    // Each large node waits for its children. The first tasks are the small
+    // subtrees hanging off large nodes; finishing the last child of a large
+    // node spawns that node on the same thread, where its children's states
+    // are likely still in cache.
+    unique_ptr<atomic<unsigned>[]> remaining(new atomic<unsigned>[id_count]);
+    vector<WorkStealingPool::Task> tasks;
+    function<void(const SyntaxTree&)> finish;
+    finish = [&](const SyntaxTree& node) {
+      const SyntaxTree* parent = parents[node.id()];
+      if (parent != nullptr && --remaining[parent->id()] == 0) {
+        pool->Spawn([&, parent] {
+          EvaluateNode(*parent, values);
+          finish(*parent);
+        });
+      }
+    };
+
+    vector<const SyntaxTree*> node_stack = {&tree};
+    while (node_stack.size() > 0) {
+      const SyntaxTree* node = node_stack.back();
+      node_stack.pop_back();
+      remaining[node->id()] = node->NumChildren();
+      for (unsigned i = 0; i < node->NumChildren(); ++i) {
+        const SyntaxTree* child = &node->GetChild(i);
+        // A node without children can't wait for any, so it is always a task
+        if (sizes[child->id()] > min_task_nodes && child->NumChildren() > 0) {
+          node_stack.push_back(child);
+        }
+        else {
+          tasks.push_back([&, child] {
+            EvaluateSubtree(*child, values);
+            finish(*child);
+          });
+        }
+      }
+    }
+    pool->Run(tasks);
+  }
+
+  vector<tuple<SyntaxTree*, vector<cnn::real>>> results;
+  for (unsigned id = 0; id < id_count; ++id) {
+    if (values.outputs[id].size() > 0) {
+      results.push_back(make_tuple((SyntaxTree*)nodes[id], values.outputs[id]));
+    }
+  }
+  return results;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <vector>
+#include <tuple>
+#include <Eigen/Dense>
+#include "cnn/cnn.h"
+#include "sentiment.h"
+#include "syntax_tree.h"
+#include "work_stealing.h"
+
+using namespace std;
+
+// A copy of a SentimentModel's weights that runs trees forward with Eigen
+// directly, without building cnn graphs. It never changes after it has
+// been built, so any number of threads may use it at once, and independent
+// subtrees of a single tree can be evaluated in parallel. With a BiLSTM
+// leaf encoder, its two directions run in parallel too.
+class NativeEvaluator {
+public:
+  // With leaf_table set, the state of a leaf holding each word is computed
+  // up front for the whole vocabulary, so that evaluating a leaf is a
+  // lookup. This is ignored for leaf encoders that read whole sentences.
+  explicit NativeEvaluator(const SentimentModel& model, bool leaf_table = false);
+
+  // Returns the same scores as SentimentModel::PredictBatched(), for each
+  // selected internal node in post-order. Given a pool, subtrees with more
+  // than min_task_nodes nodes have their roots scheduled as separate tasks
+  // once their children are done, while smaller subtrees run serially.
+  vector<tuple<SyntaxTree*, vector<cnn::real>>> Predict(const SyntaxTree& tree, const vector<bool>* selected_nodes = nullptr, WorkStealingPool* pool = nullptr, unsigned min_task_nodes = 64) const;
+
+private:
+  typedef Eigen::MatrixXf Matrix;
+  typedef Eigen::VectorXf Vector;
+
+  struct Layer {
+    Matrix x2i, x2f, x2o, x2c;
+    Vector bi, bf, bo, bc;
+    vector<Matrix> h2i, h2f, h2o, h2c, c2i, c2f, c2o;
+  };
+
+  // One layer of one direction of the leaf BiLSTM. The input weights of
+  // the i, o and c gates are stacked, in that order, so that a sentence's
+  // input projections are a single product.
+  struct LeafLayer {
+    Matrix x2ioc;
+    Vector b_ioc;
+    Matrix h2i, c2i, h2o, c2o, h2c;
+  };
+
+  // Everything computed for one tree, indexed by node id
+  struct TreeValues {
+    vector<vector<Vector>> h; // Then by layer
+    vector<vector<Vector>> c;
+    vector<vector<cnn::real>> outputs; // Empty for nodes without outputs
+    const vector<bool>* selected_nodes;
+    Matrix leaves; // With a BiLSTM, each terminal's annotation, left to right
+    vector<unsigned> leaf_columns; // Column of leaves holding each terminal
+  };
+
+  static vector<LeafLayer> CopyLeafLayers(const LSTMBuilder& builder);
+  static Matrix RunLeafLSTM(const vector<LeafLayer>& layers, Matrix inputs, bool reverse);
+  void BuildLeafTable();
+  void EncodeLeaves(const vector<const SyntaxTree*>& nodes, TreeValues& values, WorkStealingPool* pool) const;
+  void EvaluateNode(const SyntaxTree& node, TreeValues& values) const;
+  void EvaluateSubtree(const SyntaxTree& tree, TreeValues& values) const;
+
+  vector<Layer> layers;
+  vector<LeafLayer> forward_layers, reverse_layers; // Empty without a BiLSTM
+  Matrix embeddings; // One column per word
+  vector<Matrix> leaf_h, leaf_c; // With a leaf table, each layer's leaf states, one column per word
+  Matrix fIH, fHO;
+  Vector fHb, fOb;
+  unsigned N;
+
+  friend class ModelExporter;
+};
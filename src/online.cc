@@ -0,0 +1,314 @@
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/program_options.hpp>
+
+#include <cassert>
+#include <iostream>
+#include <fstream>
+#include <csignal>
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sentiment.h"
+#include "memory.h"
+#include "corpus.h"
+#include "train.h"
+#include "model_io.h"
+#include "training_loop.h"
+
+using namespace cnn;
+using namespace std;
+namespace po = boost::program_options;
+
+// Newly labeled trees, parsed on a reader thread as they arrive. Reading
+// stdin may block forever, so the reader is detached and shares this with
+// main() rather than being joined.
+struct Arrivals {
+  mutex lock;
+  condition_variable ready;
+  deque<SyntaxTree> trees;
+  bool finished = false;
+};
+
+static void ReadLines(istream& in, Vocabulary* vocab, Arrivals& arrivals) {
+  for (string line; getline(in, line);) {
+    if (line.empty()) {
+      continue;
+    }
+    SyntaxTree tree(line, vocab);
+    tree.AssignNodeIds();
+    {
+      lock_guard<mutex> guard(arrivals.lock);
+      arrivals.trees.push_back(move(tree));
+    }
+    arrivals.ready.notify_one();
+  }
+}
+
+static void Finish(Arrivals& arrivals) {
+  {
+    lock_guard<mutex> guard(arrivals.lock);
+    arrivals.finished = true;
+  }
+  arrivals.ready.notify_one();
+}
+
+static void ReadStdin(Vocabulary* vocab, shared_ptr<Arrivals> arrivals) {
+  ReadLines(cin, vocab, *arrivals);
+  Finish(*arrivals);
+}
+
+// Reads each file that appears in directory once, in name order. Files
+// whose names start with a dot are ignored, so that writers can create
+// them under such a name and rename them once they're complete.
+static void WatchDirectory(const string& directory, unsigned poll_seconds, Vocabulary* vocab, shared_ptr<Arrivals> arrivals) {
+  set<string> seen;
+  while (true) {
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+      cerr << "ERROR: Unable to read " << directory << endl;
+      break;
+    }
+    vector<string> names;
+    while (dirent* entry = readdir(dir)) {
+      const string name = entry->d_name;
+      if (name[0] != '.' && seen.count(name) == 0) {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+
+    sort(names.begin(), names.end());
+    for (const string& name : names) {
+      seen.insert(name);
+      ifstream f(directory + "/" + name);
+      ReadLines(f, vocab, *arrivals);
+      cerr << "Read " << name << endl;
+    }
+    this_thread::sleep_for(chrono::seconds(poll_seconds));
+  }
+  Finish(*arrivals);
+}
+
+// A uniform sample of every tree trained on so far (reservoir sampling),
+// replayed alongside new trees so that the model doesn't forget older data
+class ReplayBuffer {
+public:
+  ReplayBuffer(unsigned capacity, unsigned seed) : capacity(capacity), seen(0), rng(seed) {}
+
+  void Add(SyntaxTree tree) {
+    seen++;
+    if (trees.size() < capacity) {
+      trees.push_back(move(tree));
+    }
+    else if (capacity > 0) {
+      unsigned long j = uniform_int_distribution<unsigned long>(0, seen - 1)(rng);
+      if (j < capacity) {
+        trees[j] = move(tree);
+      }
+    }
+  }
+
+  const SyntaxTree& Sample() {
+    assert (trees.size() > 0);
+    return trees[uniform_int_distribution<unsigned>(0, trees.size() - 1)(rng)];
+  }
+
+  unsigned size() const {
+    return trees.size();
+  }
+
+private:
+  const unsigned capacity;
+  unsigned long seen;
+  vector<SyntaxTree> trees;
+  mt19937 rng;
+};
+
+// Writes the model to a temporary file beside filename, and renames it into
+// place, so that anyone loading filename only ever sees a complete model
+static bool Publish(const string& filename, Vocabulary& vocab, SentimentModel& sentiment_model, Model& cnn_model) {
+  const string temp_filename = filename + ".tmp";
+  {
+    ofstream out(temp_filename);
+    Serialize(vocab, sentiment_model, cnn_model, out);
+    out.close();
+    if (!out) {
+      cerr << "ERROR: Unable to write " << temp_filename << endl;
+      return false;
+    }
+  }
+  // Make sure the data is on disk before the rename makes it visible
+  int fd = open(temp_filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  if (rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    cerr << "ERROR: Unable to replace " << filename << endl;
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  signal (SIGINT, ctrlc_handler);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("model", po::value<string>()->required(), "Model to start from, as written by train")
+  ("output", po::value<string>()->required(), "File to publish snapshots of the updated model to. Each one atomically replaces the last.")
+  ("watch", po::value<string>(), "Read new trees from each file that appears in this directory, instead of from stdin. Files whose names start with a dot are ignored until renamed.")
+  ("poll_seconds", po::value<unsigned>()->default_value(10), "How often to look for new files with --watch")
+  ("snapshot_seconds", po::value<unsigned>()->default_value(600), "Minimum time between snapshots. A final one is written when input ends.")
+  ("batch_size,b", po::value<unsigned>()->default_value(8), "Maximum number of new trees in each update")
+  ("replay_set", po::value<string>(), "Older trees to seed the replay buffer with, e.g. the original training set")
+  ("replay_size", po::value<unsigned>()->default_value(50000), "Number of trees the replay buffer holds, sampled uniformly from everything seen")
+  ("replay_ratio", po::value<double>()->default_value(1.0), "Number of replayed trees in each update per new tree")
+  ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed. If this value is 0 a seed will be chosen randomly.")
+  ("threads,j", po::value<unsigned>()->default_value(thread::hardware_concurrency()), "Number of threads to use when reading the replay set")
+  ("max_nodes", po::value<unsigned>()->default_value(0), "Maximum number of nodes in one tree's graph (0 for no limit)")
+  ("max_graph_memory", po::value<double>()->default_value(0.0), "Maximum estimated graph memory for one tree, in MB (0 for no limit)")
+  ("oversize_policy", po::value<string>()->default_value("skip"), "What to do with trees over the limits: skip, split, stream, or checkpoint (see train). Only skip works with bilstm leaves.")
+  ("help", "Display this help message");
+  desc.add(OptimizerOptions());
+
+  po::positional_options_description positional_options;
+  positional_options.add("model", 1);
+  positional_options.add("output", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  const string output_filename = vm["output"].as<string>();
+  const unsigned batch_size = max(vm["batch_size"].as<unsigned>(), 1U);
+  const double replay_ratio = vm["replay_ratio"].as<double>();
+  const chrono::seconds snapshot_interval(vm["snapshot_seconds"].as<unsigned>());
+  TreeLimits limits;
+  limits.max_nodes = vm["max_nodes"].as<unsigned>();
+  limits.max_graph_bytes = (size_t)(vm["max_graph_memory"].as<double>() * 1024 * 1024);
+  limits.policy = ParseOversizePolicy(vm["oversize_policy"].as<string>());
+
+  cnn::Initialize(argc, argv, vm["random_seed"].as<unsigned>());
+  Vocabulary* vocab = nullptr;
+  Model* cnn_model = nullptr;
+  SentimentModel* sentiment_model = nullptr;
+  tie(vocab, cnn_model, sentiment_model) = LoadModel(vm["model"].as<string>());
+  if (!SupportsOversizePolicy(limits, *sentiment_model)) {
+    cerr << "ERROR: The model's leaf encoder reads whole sentences, so the only oversize_policy it supports is skip" << endl;
+    return 1;
+  }
+  Trainer* sgd = CreateTrainer(*cnn_model, vm);
+  const unsigned max_nodes = MaxTreeNodes(limits, *sentiment_model);
+  GraphMemoryMonitor memory_monitor;
+
+  ReplayBuffer replay(vm["replay_size"].as<unsigned>(), vm["random_seed"].as<unsigned>());
+  if (vm.count("replay_set")) {
+    vector<SyntaxTree>* replay_set = ReadTrees(vm["replay_set"].as<string>(), vocab, vm["threads"].as<unsigned>());
+    if (replay_set == nullptr) {
+      return 1;
+    }
+    for (SyntaxTree& tree : *replay_set) {
+      replay.Add(move(tree));
+    }
+    delete replay_set;
+    cerr << "Replay buffer holds " << replay.size() << " trees" << endl;
+  }
+
+  // The vocabulary is frozen, so the reader can parse trees on its own thread
+  shared_ptr<Arrivals> arrivals = make_shared<Arrivals>();
+  if (vm.count("watch")) {
+    thread(WatchDirectory, vm["watch"].as<string>(), vm["poll_seconds"].as<unsigned>(), vocab, arrivals).detach();
+  }
+  else {
+    thread(ReadStdin, vocab, arrivals).detach();
+  }
+
+  cerr << "Waiting for new trees...\n";
+  auto next_snapshot = chrono::steady_clock::now() + snapshot_interval;
+  unsigned unpublished_count = 0;
+  unsigned total_count = 0;
+  bool finished = false;
+  while (!finished && !ctrlc_pressed) {
+    vector<SyntaxTree> batch;
+    {
+      // Wake up now and then to notice ctrl-c and snapshot deadlines
+      unique_lock<mutex> guard(arrivals->lock);
+      arrivals->ready.wait_for(guard, chrono::seconds(1), [&] { return arrivals->trees.size() > 0 || arrivals->finished; });
+      while (batch.size() < batch_size && arrivals->trees.size() > 0) {
+        batch.push_back(move(arrivals->trees.front()));
+        arrivals->trees.pop_front();
+      }
+      finished = arrivals->finished && arrivals->trees.size() == 0;
+    }
+
+    if (batch.size() > 0) {
+      cnn::real loss = 0.0;
+      unsigned node_count = 0;
+      unsigned oversize_count = 0;
+      for (const SyntaxTree& tree : batch) {
+        CatchUpRows(sgd, *sentiment_model, {&tree});
+        loss += ProcessTree(tree, *sentiment_model, limits, max_nodes, true, memory_monitor, &node_count, &oversize_count);
+      }
+      const unsigned replay_count = min(replay.size(), (unsigned)round(batch.size() * replay_ratio));
+      unsigned replay_node_count = 0;
+      for (unsigned i = 0; i < replay_count; ++i) {
+        const SyntaxTree& tree = replay.Sample();
+        CatchUpRows(sgd, *sentiment_model, {&tree});
+        ProcessTree(tree, *sentiment_model, limits, max_nodes, true, memory_monitor, &replay_node_count, &oversize_count);
+      }
+      sgd->update(1.0 / (batch.size() + replay_count));
+
+      for (SyntaxTree& tree : batch) {
+        replay.Add(move(tree));
+      }
+      unpublished_count += batch.size();
+      total_count += batch.size();
+      cerr << "Trained on " << batch.size() << " new trees (" << total_count << " in total) and " << replay_count << " replayed, new tree loss per node: " << loss / max(node_count, 1U);
+      if (oversize_count > 0) {
+        cerr << ", oversize: " << oversize_count;
+      }
+      cerr << endl;
+    }
+
+    const auto now = chrono::steady_clock::now();
+    if (unpublished_count > 0 && now >= next_snapshot) {
+      FlushTrainer(sgd);
+      if (Publish(output_filename, *vocab, *sentiment_model, *cnn_model)) {
+        cerr << "Published a snapshot including " << unpublished_count << " new trees" << endl;
+        unpublished_count = 0;
+      }
+      next_snapshot = now + snapshot_interval;
+    }
+  }
+
+  if (unpublished_count > 0) {
+    FlushTrainer(sgd);
+    if (!Publish(output_filename, *vocab, *sentiment_model, *cnn_model)) {
+      return 1;
+    }
+    cerr << "Published a final snapshot including " << unpublished_count << " new trees" << endl;
+  }
+  return 0;
+}
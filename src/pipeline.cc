@@ -0,0 +1,71 @@
+#include "pipeline.h"
+
+TreePipeline::TreePipeline(Source source, unsigned depth) : source(source), depth(max(depth, 1U)), finished(false), stopping(false) {
+  producer = thread(&TreePipeline::Produce, this);
+}
+
+TreePipeline::~TreePipeline() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  not_full.notify_all();
+  producer.join();
+}
+
+unique_ptr<PreparedTree> TreePipeline::Next() {
+  unique_lock<mutex> guard(lock);
+  not_empty.wait(guard, [this] { return ready.size() > 0 || finished; });
+  if (ready.size() == 0) {
+    return nullptr;
+  }
+  unique_ptr<PreparedTree> prepared = move(ready.front());
+  ready.pop_front();
+  guard.unlock();
+  not_full.notify_one();
+  return prepared;
+}
+
+void TreePipeline::Produce() {
+  while (true) {
+    unique_ptr<PreparedTree> prepared = source();
+    if (prepared == nullptr) {
+      break;
+    }
+    prepared->plan = SentimentModel::PlanTree(*prepared->tree);
+
+    unique_lock<mutex> guard(lock);
+    not_full.wait(guard, [this] { return ready.size() < depth || stopping; });
+    if (stopping) {
+      break;
+    }
+    ready.push_back(move(prepared));
+    guard.unlock();
+    not_empty.notify_one();
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    finished = true;
+  }
+  not_empty.notify_all();
+}
+
+AsyncUpdate::AsyncUpdate() {}
+
+AsyncUpdate::~AsyncUpdate() {
+  Wait();
+}
+
+void AsyncUpdate::Start(Trainer* trainer, cnn::real scale) {
+  Wait();
+  worker = thread([trainer, scale] {
+    trainer->update(scale);
+  });
+}
+
+void AsyncUpdate::Wait() {
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include "cnn/training.h"
+#include "sentiment.h"
+#include "syntax_tree.h"
+
+using namespace std;
+using namespace cnn;
+
+// A training tree along with its plan
+struct PreparedTree {
+  unsigned index; // Position in the training set, or in the stream
+  unique_ptr<SyntaxTree> owned; // Set if nothing else owns the tree
+  const SyntaxTree* tree;
+  TreePlan plan;
+};
+
+// Prepares trees on a background thread, staying at most depth trees ahead
+// of whoever calls Next(). source is called only on that thread, and
+// returns trees with everything but their plans filled in, or nullptr once
+// there are no more.
+class TreePipeline {
+public:
+  typedef function<unique_ptr<PreparedTree>()> Source;
+
+  TreePipeline(Source source, unsigned depth);
+  ~TreePipeline();
+  TreePipeline(const TreePipeline&) = delete;
+  TreePipeline& operator=(const TreePipeline&) = delete;
+
+  // Returns nullptr once every tree has been returned
+  unique_ptr<PreparedTree> Next();
+
+private:
+  void Produce();
+
+  Source source;
+  const unsigned depth;
+  deque<unique_ptr<PreparedTree>> ready;
+  bool finished;
+  bool stopping;
+  mutex lock;
+  condition_variable not_empty;
+  condition_variable not_full;
+  thread producer;
+};
+
+// Applies a trainer's update on a helper thread, so that the next graph can
+// be built in the meantime. Building a graph doesn't read parameter values
+// or gradients, but running it does, so Wait() must be called before
+// anything runs a graph, reads the parameters, or starts another update.
+class AsyncUpdate {
+public:
+  AsyncUpdate();
+  ~AsyncUpdate();
+  AsyncUpdate(const AsyncUpdate&) = delete;
+  AsyncUpdate& operator=(const AsyncUpdate&) = delete;
+
+  void Start(Trainer* trainer, cnn::real scale);
+  void Wait();
+
+private:
+  thread worker;
+};
@@ -1,15 +1,24 @@
 #include "cnn/cnn.h"
 #include "cnn/training.h"
 
-#include <boost/archive/text_iarchive.hpp>
 #include <boost/program_options.hpp>
 
 #include <iostream>
 #include <fstream>
 #include <csignal>
 #include <vector>
+#include <set>
+#include <sstream>
+#include <memory>
+#include <limits>
 
 #include "sentiment.h"
+#include "corpus.h"
+#include "memory.h"
+#include "subtree_cache.h"
+#include "model_io.h"
+#include "native_evaluator.h"
+#include "work_stealing.h"
 
 using namespace cnn;
 using namespace std;
@@ -25,29 +34,6 @@ void ctrlc_handler(int signal) {
   }
 }
 
-tuple<Dict*, Model*, SentimentModel*> LoadModel(string model_filename) {
-  ifstream model_file(model_filename);
-  if (!model_file.is_open()) {
-    cerr << "ERROR: Unable to open " << model_filename << endl;
-    exit(1);
-  }
-  boost::archive::text_iarchive ia(model_file);
-
-  Dict* vocab = new Dict();
-  ia & *vocab;
-  vocab->Freeze();
-
-  Model* cnn_model = new Model();
-  SentimentModel* sentiment_model = new SentimentModel();
-
-  ia & *sentiment_model;
-  sentiment_model->InitializeParameters(*cnn_model, vocab->size());
-
-  ia & *cnn_model;
-
-  return make_tuple(vocab, cnn_model, sentiment_model);
-}
-
 unsigned argmax(const vector<float>& probs) {
   assert (probs.size() > 0);
   unsigned m = 0;
@@ -59,12 +45,72 @@ unsigned argmax(const vector<float>& probs) {
   return m;
 }
 
+// Parses a list of terminal spans such as "0:5,2:3", where 0:5 is the span
+// covering the first five terminals
+set<pair<unsigned, unsigned>> ParseSpans(const string& spans_string) {
+  set<pair<unsigned, unsigned>> spans;
+  stringstream ss(spans_string);
+  for (string span; getline(ss, span, ',');) {
+    unsigned start, end;
+    char colon;
+    stringstream span_stream(span);
+    if (!(span_stream >> start >> colon >> end) || colon != ':' || end <= start) {
+      cerr << "ERROR: Invalid span \"" << span << "\". Spans should look like start:end." << endl;
+      exit(1);
+    }
+    spans.insert(make_pair(start, end));
+  }
+  return spans;
+}
+
+// Parses a shard such as "3/8", the fourth of eight
+void ParseShard(const string& shard_string, unsigned* shard, unsigned* shard_count) {
+  char slash;
+  stringstream ss(shard_string);
+  if (!(ss >> *shard >> slash >> *shard_count) || slash != '/' || *shard >= *shard_count) {
+    cerr << "ERROR: Invalid shard \"" << shard_string << "\". Shards should look like i/n, with i < n." << endl;
+    exit(1);
+  }
+}
+
+// Runs the model over all of tree in a single graph
+vector<tuple<SyntaxTree*, vector<float>>> PredictValues(SentimentModel& sentiment_model, const SyntaxTree& tree, GraphMemoryMonitor& monitor, const vector<bool>* selected_nodes) {
+  ComputationGraph cg;
+  vector<SyntaxTree*> nodes;
+  Expression predictions = sentiment_model.PredictBatched(tree, cg, &nodes, nullptr, selected_nodes);
+  cg.forward();
+  monitor.Observe();
+
+  vector<tuple<SyntaxTree*, vector<float>>> values;
+  if (nodes.size() > 0) {
+    vector<vector<float>> columns = ReadColumns(predictions);
+    for (unsigned i = 0; i < nodes.size(); ++i) {
+      values.push_back(make_tuple(nodes[i], columns[i]));
+    }
+  }
+  return values;
+}
+
 int main(int argc, char** argv) {
   signal (SIGINT, ctrlc_handler);
 
   po::options_description desc("description");
   desc.add_options()
   ("model", po::value<string>()->required(), "model file, as output by train")
+  ("input", po::value<string>(), "File of trees to score, instead of stdin")
+  ("output", po::value<string>(), "File to write predictions to, instead of stdout")
+  ("shard", po::value<string>(), "Only score shard i/n of --input, splitting the file into n byte ranges at line boundaries. Sentences are numbered from 0 within the shard, and the shard's line count is written to the sidecar file <output>.idx on completion; merge_predictions joins the shards with global sentence numbers.")
+  ("max_nodes", po::value<unsigned>()->default_value(0), "Maximum number of nodes in one tree's graph (0 for no limit)")
+  ("max_graph_memory", po::value<double>()->default_value(0.0), "Maximum estimated graph memory for one tree, in MB (0 for no limit)")
+  ("oversize_policy", po::value<string>()->default_value("stream"), "What to do with trees over the limits: skip, split (into constituents that fit, so the root gets no prediction; not allowed with --root_only), or stream (chunk by chunk, with identical results). Checkpoint is the same as stream here. Models with bilstm leaves only support skip, which they use by default.")
+  ("memory_report", "Report each tree's peak graph memory on stderr")
+  ("leaf_table", "With --threads, compute the leaf state of every word in the vocabulary at startup, so that each leaf is a lookup")
+  ("cache_size", po::value<unsigned>()->default_value(0), "Number of subtree encodings to cache and reuse across sentences, each holding one node's state and output (0 to disable)")
+  ("threads,j", po::value<unsigned>()->default_value(0), "Evaluate trees directly on this many threads, running independent subtrees in parallel, instead of through cnn graphs (0 to use cnn). Graph memory limits and the subtree cache don't apply.")
+  ("min_task_nodes", po::value<unsigned>()->default_value(64), "With --threads, subtrees of at most this many nodes (at least 1) are evaluated serially as a single task")
+  ("root_only", "Only output predictions for the root of each tree")
+  ("min_span", po::value<unsigned>()->default_value(0), "Only output predictions for nodes covering at least this many terminals")
+  ("spans", po::value<string>(), "Only output predictions for these terminal spans, e.g. 0:5,2:3 (end exclusive)")
   ("help", "Display this help message");
 
   po::positional_options_description positional_options;
@@ -81,39 +127,153 @@ int main(int argc, char** argv) {
   po::notify(vm);
 
   string model_filename = vm["model"].as<string>();
+  TreeLimits limits;
+  limits.max_nodes = vm["max_nodes"].as<unsigned>();
+  limits.max_graph_bytes = (size_t)(vm["max_graph_memory"].as<double>() * 1024 * 1024);
+  limits.policy = ParseOversizePolicy(vm["oversize_policy"].as<string>());
+  const bool memory_report = vm.count("memory_report") > 0;
+  const unsigned num_threads = vm["threads"].as<unsigned>();
+  const unsigned min_task_nodes = vm["min_task_nodes"].as<unsigned>();
+  if (min_task_nodes == 0) {
+    cerr << "ERROR: --min_task_nodes must be at least 1" << endl;
+    return 1;
+  }
+  unsigned cache_size = vm["cache_size"].as<unsigned>();
+  OutputSelection selection;
+  selection.root_only = vm.count("root_only") > 0;
+  selection.min_span = vm["min_span"].as<unsigned>();
+  if (vm.count("spans")) {
+    selection.spans = ParseSpans(vm["spans"].as<string>());
+  }
+  // Split trees have no root to predict
+  if (selection.root_only && limits.policy == SPLIT_OVERSIZE) {
+    cerr << "ERROR: --root_only can't be combined with --oversize_policy split, which never predicts the root of an oversize tree" << endl;
+    return 1;
+  }
+  unsigned shard = 0;
+  unsigned shard_count = 1;
+  const bool sharded = vm.count("shard") > 0;
+  if (sharded) {
+    ParseShard(vm["shard"].as<string>(), &shard, &shard_count);
+    if (!vm.count("input") || !vm.count("output")) {
+      cerr << "ERROR: --shard needs both --input and --output" << endl;
+      return 1;
+    }
+  }
+
+  // When sharding, reading stops at the first line of the next shard
+  ifstream input_file;
+  size_t stop = numeric_limits<size_t>::max();
+  if (vm.count("input")) {
+    const string input_filename = vm["input"].as<string>();
+    if (!OpenShard(input_filename, shard, shard_count, &input_file, &stop)) {
+      cerr << "ERROR: Unable to open " << input_filename << endl;
+      return 1;
+    }
+  }
+  istream& in = input_file.is_open() ? input_file : cin;
+  ofstream output_file;
+  if (vm.count("output")) {
+    output_file.open(vm["output"].as<string>());
+    if (!output_file.is_open()) {
+      cerr << "ERROR: Unable to write " << vm["output"].as<string>() << endl;
+      return 1;
+    }
+  }
+  ostream& out = output_file.is_open() ? output_file : cout;
   cnn::Initialize(argc, argv);
 
-  Dict* vocab = nullptr;
+  Vocabulary* vocab = nullptr;
   Model* cnn_model = nullptr;
   SentimentModel* sentiment_model = nullptr;
   tie(vocab, cnn_model, sentiment_model) = LoadModel(model_filename);
 
   vocab->Freeze();
 
+  // Pieces of a tree would only see their own words. The native evaluator
+  // always scores whole trees, so it isn't affected.
+  if (num_threads == 0 && !SupportsOversizePolicy(limits, *sentiment_model)) {
+    if (!vm["oversize_policy"].defaulted()) {
+      cerr << "ERROR: The model's leaf encoder reads whole sentences, so the only oversize_policy it supports is skip" << endl;
+      return 1;
+    }
+    limits.policy = SKIP_OVERSIZE;
+  }
+
+  // A subtree's encoding depends on the rest of its sentence
+  if (cache_size > 0 && sentiment_model->HasContextualLeaves()) {
+    cerr << "The model's leaf encoder reads whole sentences, so the subtree cache is disabled." << endl;
+    cache_size = 0;
+  }
+  SubtreeCache cache(cache_size);
+
+  unique_ptr<NativeEvaluator> native_evaluator;
+  unique_ptr<WorkStealingPool> pool;
+  if (num_threads > 0) {
+    native_evaluator.reset(new NativeEvaluator(*sentiment_model, vm.count("leaf_table") > 0));
+    pool.reset(new WorkStealingPool(num_threads));
+  }
+
+  const unsigned max_nodes = MaxTreeNodes(limits, *sentiment_model);
+  GraphMemoryMonitor memory_monitor;
+  if (memory_report) {
+    cerr << "Parameter memory: " << FormatBytes(ParameterBytes(*cnn_model)) << endl;
+  }
+
   string line;
   unsigned sentence_number = 0;
-  while(getline(cin, line)) {
+  while ((!sharded || (size_t)in.tellg() < stop) && getline(in, line)) {
     SyntaxTree tree(line, vocab);
     tree.AssignNodeIds();
 
-    ComputationGraph cg;
-    vector<tuple<SyntaxTree*, Expression>> predictions = sentiment_model->Predict(tree, cg);
-    cg.forward();
+    const unsigned node_count = tree.NumNodes();
+    memory_monitor.ResetPeak();
+    vector<bool> selected_nodes;
+    if (!selection.SelectsAll()) {
+      selected_nodes = selection.SelectNodes(tree);
+    }
+    const vector<bool>* selected = selection.SelectsAll() ? nullptr : &selected_nodes;
+
+    vector<tuple<SyntaxTree*, vector<float>>> predictions;
+    if (native_evaluator != nullptr) {
+      predictions = native_evaluator->Predict(tree, selected, pool.get(), min_task_nodes);
+    }
+    else if (node_count <= max_nodes && cache.capacity() > 0) {
+      predictions = PredictCached(*sentiment_model, tree, cache, &memory_monitor, selected);
+    }
+    else if (node_count <= max_nodes) {
+      predictions = PredictValues(*sentiment_model, tree, memory_monitor, selected);
+    }
+    else if (limits.policy == SPLIT_OVERSIZE) {
+      for (const SyntaxTree* piece : SplitTree(tree, max_nodes)) {
+        vector<tuple<SyntaxTree*, vector<float>>> piece_predictions = PredictValues(*sentiment_model, *piece, memory_monitor, selected);
+        predictions.insert(predictions.end(), piece_predictions.begin(), piece_predictions.end());
+      }
+    }
+    else if (limits.policy == STREAM_OVERSIZE || limits.policy == CHECKPOINT_OVERSIZE) {
+      predictions = PredictStreaming(*sentiment_model, tree, max_nodes, &memory_monitor, selected);
+    }
+    else {
+      cerr << "Skipping sentence " << sentence_number << " with " << node_count << " nodes" << endl;
+    }
+
+    if (memory_report) {
+      cerr << "Sentence " << sentence_number << ": " << node_count << " nodes, peak graph memory " << FormatBytes(memory_monitor.peak_bytes()) << ", high water " << FormatBytes(memory_monitor.high_water_bytes()) << endl;
+    }
 
     for (auto t : predictions) {
       SyntaxTree* tree;
-      Expression predictions;
-      tie(tree, predictions) = t;
-      vector<float> p = as_vector(predictions.value());
-      cout << sentence_number << " ||| ";
+      vector<float> p;
+      tie(tree, p) = t;
+      out << sentence_number << " ||| ";
       for (WordId w : tree->GetTerminals()) {
-        cout << vocab->Convert(w) << " ";
+        out << vocab->Convert(w) << " ";
       }
-      cout << "||| " << tree->sentiment() << " ||| " << argmax(p) << " |||";
+      out << "||| " << tree->sentiment() << " ||| " << argmax(p) << " |||";
       for (float v : p) {
-        cout << " " << v;
+        out << " " << v;
       }
-      cout << "\n";
+      out << "\n";
     }
 
     sentence_number++;
@@ -123,5 +283,21 @@ int main(int argc, char** argv) {
     }
   }
 
+  // The sidecar marks the shard as complete
+  if (sharded && !ctrlc_pressed) {
+    output_file.close();
+    ofstream index(vm["output"].as<string>() + ".idx");
+    index << shard << " " << shard_count << " " << sentence_number << "\n";
+    index.close();
+    if (!output_file || !index) {
+      cerr << "ERROR: Unable to write " << vm["output"].as<string>() << endl;
+      return 1;
+    }
+  }
+
+  if (cache.capacity() > 0) {
+    cerr << "Subtree cache: " << cache.hits() << " hits, " << cache.misses() << " misses (" << 100.0 * cache.hit_rate() << "% hit rate), " << cache.size() << " entries" << endl;
+  }
+
   return 0;
 }
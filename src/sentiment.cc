@@ -1,4 +1,9 @@
 #include "sentiment.h"
+#include "colwise_loss.h"
+#include "embeddings.h"
+#include <algorithm>
+#include <numeric>
+#include <iostream>
 
 Expression MLP::Feed(vector<Expression> inputs) const {
   assert (inputs.size() == i_IH.size());
@@ -14,6 +19,74 @@ Expression MLP::Feed(vector<Expression> inputs) const {
   return output;
 }
 
+Expression MLP::FeedBatch(vector<Expression> inputs) const {
+  assert (inputs.size() == i_IH.size());
+  vector<Expression> products(inputs.size());
+  for (unsigned i = 0; i < inputs.size(); ++i) {
+    products[i] = i_IH[i] * inputs[i];
+  }
+  Expression hidden1 = colwise_add(sum(products), i_Hb);
+  Expression hidden2 = tanh(hidden1);
+  Expression output = colwise_add(i_HO * hidden2, i_Ob);
+  return output;
+}
+
+vector<vector<cnn::real>> ReadColumns(const Expression& matrix) {
+  const Tensor& t = matrix.value();
+  const unsigned rows = t.d.rows();
+  vector<vector<cnn::real>> columns(t.d.cols());
+  for (unsigned j = 0; j < columns.size(); ++j) {
+    columns[j].assign(t.v + j * rows, t.v + (j + 1) * rows);
+  }
+  return columns;
+}
+
+bool OutputSelection::SelectsAll() const {
+  return !root_only && min_span <= 1 && spans.size() == 0;
+}
+
+// Returns the index one past tree's last terminal
+static unsigned SelectNodes(const SyntaxTree& tree, const OutputSelection& selection, unsigned start, bool is_root, vector<bool>* selected) {
+  if (tree.IsTerminal()) {
+    return start + 1;
+  }
+
+  unsigned end = start;
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    end = SelectNodes(tree.GetChild(i), selection, end, false, selected);
+  }
+
+  bool is_selected = true;
+  if (selection.root_only && !is_root) {
+    is_selected = false;
+  }
+  if (end - start < selection.min_span) {
+    is_selected = false;
+  }
+  if (selection.spans.size() > 0 && selection.spans.count(make_pair(start, end)) == 0) {
+    is_selected = false;
+  }
+  (*selected)[tree.id()] = is_selected;
+  return end;
+}
+
+vector<bool> OutputSelection::SelectNodes(const SyntaxTree& tree) const {
+  vector<bool> selected(tree.id() + 1, false);
+  ::SelectNodes(tree, *this, 0, true, &selected);
+  return selected;
+}
+
+LeafEncoder ParseLeafEncoder(const string& name) {
+  if (name == "lookup") {
+    return LOOKUP_LEAVES;
+  }
+  else if (name == "bilstm") {
+    return BILSTM_LEAVES;
+  }
+  cerr << "Invalid leaf encoder \"" << name << "\". Please use lookup or bilstm." << endl;
+  exit(1);
+}
+
 SentimentModel::SentimentModel() {
 }
 
@@ -21,12 +94,16 @@ SentimentModel::SentimentModel(Model& model, unsigned vocab_size) {
   InitializeParameters(model, vocab_size);
 }
 
+SentimentModel::SentimentModel(unsigned word_embedding_dim, unsigned node_embedding_dim, unsigned final_hidden_dim, unsigned lstm_layer_count, unsigned max_branching_factor, LeafEncoder leaf_encoder) :
+  lstm_layer_count(lstm_layer_count), word_embedding_dim(word_embedding_dim), node_embedding_dim(node_embedding_dim), final_hidden_dim(final_hidden_dim), max_branching_factor(max_branching_factor), leaf_encoder(leaf_encoder) {
+}
+
 void SentimentModel::InitializeParameters(Model& model, unsigned vocab_size) {
   assert (node_embedding_dim % 2 == 0);
   const unsigned half_node_embedding_dim = node_embedding_dim / 2;
   forward_builder = LSTMBuilder(lstm_layer_count, word_embedding_dim, half_node_embedding_dim, &model);
   reverse_builder = LSTMBuilder(lstm_layer_count, word_embedding_dim, half_node_embedding_dim, &model); 
-  tree_builder = TreeLSTMBuilder(5, lstm_layer_count, node_embedding_dim, node_embedding_dim, &model);
+  tree_builder = TreeLSTMBuilder(max_branching_factor, lstm_layer_count, LeafAnnotationDim(), node_embedding_dim, &model);
 
   p_E = model.add_lookup_parameters(vocab_size, {word_embedding_dim});
 
@@ -34,104 +111,395 @@ void SentimentModel::InitializeParameters(Model& model, unsigned vocab_size) {
   p_fHb = model.add_parameters({final_hidden_dim});
   p_fHO = model.add_parameters({5, final_hidden_dim});
   p_fOb = model.add_parameters({5});
+}
+
+unsigned SentimentModel::InitializeEmbeddings(const PretrainedEmbeddings& pretrained, const Vocabulary& vocab) {
+  assert (pretrained.dim() == word_embedding_dim);
+  unsigned found_count = 0;
+  for (WordId id = 0; id < (WordId)vocab.size(); ++id) {
+    const float* row = pretrained.Find(vocab.Convert(id), vocab.Length(id));
+    if (row != nullptr) {
+      p_E->Initialize(id, vector<float>(row, row + word_embedding_dim));
+      ++found_count;
+    }
+  }
+  return found_count;
+}
+
+unsigned SentimentModel::WordEmbeddingDim() const {
+  return word_embedding_dim;
+}
 
-  zero_annotation.resize(node_embedding_dim);
+unsigned SentimentModel::LeafAnnotationDim() const {
+  return (leaf_encoder == BILSTM_LEAVES) ? node_embedding_dim : word_embedding_dim;
 }
 
-Expression SentimentModel::CalculateLoss(const vector<tuple<SyntaxTree*, Expression>>& results, ComputationGraph& cg) {
+bool SentimentModel::HasContextualLeaves() const {
+  return leaf_encoder == BILSTM_LEAVES;
+}
+
+vector<pair<LookupParameters*, vector<unsigned>>> SentimentModel::LookupRows(const vector<const SyntaxTree*>& trees) const {
+  vector<unsigned> words;
+  for (const SyntaxTree* tree : trees) {
+    for (WordId word : tree->GetTerminals()) {
+      words.push_back(word);
+    }
+  }
+  sort(words.begin(), words.end());
+  words.erase(unique(words.begin(), words.end()), words.end());
+
+  vector<pair<LookupParameters*, vector<unsigned>>> rows = {make_pair(p_E, words)};
+  for (const vector<LookupParameters*>& layer : tree_builder.lparams) {
+    for (LookupParameters* p : layer) {
+      vector<unsigned> positions(p->values.size());
+      iota(positions.begin(), positions.end(), 0);
+      rows.push_back(make_pair(p, positions));
+    }
+  }
+  return rows;
+}
+
+Expression SentimentModel::CalculateLoss(const vector<tuple<SyntaxTree*, Expression>>& results, ComputationGraph& cg, cnn::real weight) {
   vector<Expression> losses(results.size());
   for (unsigned i = 0; i < results.size(); ++i) {
     const SyntaxTree* tree = get<0>(results[i]);
     Expression prediction = get<1>(results[i]);
     losses[i] = pickneglogsoftmax(prediction, tree->sentiment());
   }
-  return sum(losses);
+  return (weight != 1.0) ? sum(losses) * weight : sum(losses);
 }
 
-void SentimentModel::CalculateOutputs(const SyntaxTree& tree, const vector<Expression>& annotations, const MLP& final_mlp, ComputationGraph& cg, vector<tuple<SyntaxTree*, Expression>>* results) {
+Expression SentimentModel::CalculateBatchedLoss(const vector<SyntaxTree*>& nodes, const Expression& outputs, ComputationGraph& cg, const vector<cnn::real>& weights) {
+  if (nodes.size() == 0) {
+    return input(cg, 0.0f);
+  }
+
+  vector<unsigned> labels(nodes.size());
+  for (unsigned i = 0; i < nodes.size(); ++i) {
+    labels[i] = nodes[i]->sentiment();
+  }
+  return colwise_pickneglogsoftmax(outputs, labels, weights);
+}
+
+// Appends the nodes of tree that need outputs, in post-order
+static void FindOutputNodes(const SyntaxTree& tree, const map<unsigned, NodeState>* fixed_states, const vector<bool>* selected_nodes, vector<SyntaxTree*>* nodes) {
+  if (fixed_states != nullptr && fixed_states->count(tree.id()) > 0) {
+    return;
+  }
+
   if (tree.NumChildren() > 0) {
     for (unsigned i = 0; i < tree.NumChildren(); ++i) {
-      const SyntaxTree& child = tree.GetChild(i);
-      CalculateOutputs(child, annotations, final_mlp, cg, results);
+      FindOutputNodes(tree.GetChild(i), fixed_states, selected_nodes, nodes);
+    }
+
+    if (selected_nodes != nullptr) {
+      assert (tree.id() < selected_nodes->size());
+      if (!(*selected_nodes)[tree.id()]) {
+        return;
+      }
     }
+    nodes->push_back((SyntaxTree*)&tree);
+  }
+}
 
-    assert (tree.id() < annotations.size());
-    Expression my_output = final_mlp.Feed({annotations[tree.id()]});
-    results->push_back(make_tuple((SyntaxTree*)&tree, my_output));
+void SentimentModel::CalculateOutputs(const SyntaxTree& tree, const vector<Expression>& annotations, const MLP& final_mlp, ComputationGraph& cg, vector<tuple<SyntaxTree*, Expression>>* results, const map<unsigned, NodeState>* fixed_states, const vector<bool>* selected_nodes) {
+  vector<SyntaxTree*> nodes;
+  FindOutputNodes(tree, fixed_states, selected_nodes, &nodes);
+  for (SyntaxTree* node : nodes) {
+    assert (node->id() < annotations.size());
+    Expression my_output = final_mlp.Feed({annotations[node->id()]});
+    results->push_back(make_tuple(node, my_output));
   }
 }
 
-vector<Expression> SentimentModel::BuildLinearAnnotationVectors(const SyntaxTree& tree, ComputationGraph& cg) {
-  const bool use_bidirectional = false;
-  if (use_bidirectional) {
-    vector<Expression> forward_annotations = BuildForwardAnnotations(tree.GetTerminals(), cg);
-    vector<Expression> reverse_annotations = BuildReverseAnnotations(tree.GetTerminals(), cg);
-    vector<Expression> linear_annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
-    return linear_annotations;
+Expression SentimentModel::CalculateBatchedOutputs(const vector<Expression>& node_annotations, const MLP& final_mlp) {
+  assert (node_annotations.size() > 0);
+  return final_mlp.FeedBatch({concatenate_cols(node_annotations)});
+}
+
+// Marks which of tree's terminals are outside of every fixed subtree
+static void FindVisibleTerminals(const SyntaxTree& tree, const map<unsigned, NodeState>* fixed_states, bool visible, vector<bool>* result) {
+  if (fixed_states != nullptr && fixed_states->count(tree.id()) > 0) {
+    visible = false;
+  }
+
+  if (tree.IsTerminal()) {
+    result->push_back(visible);
   }
   else {
-    vector<Expression> linear_annotations;
-    for (WordId w : tree.GetTerminals()) {
-      linear_annotations.push_back(lookup(cg, p_E, w));
+    for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+      FindVisibleTerminals(tree.GetChild(i), fixed_states, visible, result);
     }
-    return linear_annotations;
   }
 }
 
-vector<tuple<SyntaxTree*, Expression>> SentimentModel::Predict(const SyntaxTree& tree, ComputationGraph& cg) {
-  vector<Expression> linear_annotations = BuildLinearAnnotationVectors(tree, cg);
-  vector<Expression> tree_annotations = BuildTreeAnnotationVectors(tree, linear_annotations, cg);
-  assert (tree_annotations.size() == tree.NumNodes());
+// Runs one direction of an LSTMBuilder's layers over several sentences at
+// once, whose words are the columns of inputs, one sentence after another.
+// Returns the top layer's output for each column. The input projections of
+// a layer are one product over every word, and each time step is one
+// product over every sentence still running, which are kept longest first
+// so that they are always a prefix of the previous step's. The arithmetic
+// is that of LSTMBuilder::add_input().
+static vector<Expression> RunBatchedLSTM(const LSTMBuilder& builder, Expression inputs, const vector<unsigned>& lengths, bool reverse, ComputationGraph& cg) {
+  // The order of LSTMBuilder's parameters within a layer
+  enum { X2I, H2I, C2I, BI, X2O, H2O, C2O, BO, X2C, H2C, BC };
+
+  vector<unsigned> starts(lengths.size());
+  unsigned total = 0;
+  for (unsigned s = 0; s < lengths.size(); ++s) {
+    starts[s] = total;
+    total += lengths[s];
+  }
+  vector<unsigned> order(lengths.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return lengths[a] > lengths[b]; });
+  const unsigned max_length = (order.size() > 0) ? lengths[order[0]] : 0;
+
+  vector<Expression> outputs(total);
+  for (unsigned l = 0; l < builder.layers; ++l) {
+    const vector<Parameters*>& p = builder.params[l];
+    Expression all_i = colwise_add(parameter(cg, p[X2I]) * inputs, parameter(cg, p[BI]));
+    Expression all_o = colwise_add(parameter(cg, p[X2O]) * inputs, parameter(cg, p[BO]));
+    Expression all_w = colwise_add(parameter(cg, p[X2C]) * inputs, parameter(cg, p[BC]));
+    Expression h2i = parameter(cg, p[H2I]);
+    Expression c2i = parameter(cg, p[C2I]);
+    Expression h2o = parameter(cg, p[H2O]);
+    Expression c2o = parameter(cg, p[C2O]);
+    Expression h2c = parameter(cg, p[H2C]);
+
+    Expression h, c;
+    unsigned running = 0;
+    for (unsigned k = 0; k < max_length; ++k) {
+      // The column of each running sentence's k-th word in this direction
+      vector<unsigned> columns;
+      for (unsigned s : order) {
+        if (lengths[s] <= k) {
+          break;
+        }
+        columns.push_back(starts[s] + (reverse ? lengths[s] - 1 - k : k));
+      }
+      Expression a_i = colwise_select(all_i, columns);
+      Expression a_o = colwise_select(all_o, columns);
+      Expression a_w = colwise_select(all_w, columns);
+      if (k == 0) {
+        Expression i_t = logistic(a_i);
+        c = cwise_multiply(i_t, tanh(a_w));
+        h = cwise_multiply(logistic(affine_transform({a_o, c2o, c})), tanh(c));
+      }
+      else {
+        if (columns.size() < running) {
+          vector<unsigned> still_running(columns.size());
+          iota(still_running.begin(), still_running.end(), 0);
+          h = colwise_select(h, still_running);
+          c = colwise_select(c, still_running);
+        }
+        Expression i_t = logistic(affine_transform({a_i, h2i, h, c2i, c}));
+        Expression w_t = tanh(affine_transform({a_w, h2c, h}));
+        c = cwise_multiply(1.0f - i_t, c) + cwise_multiply(i_t, w_t);
+        h = cwise_multiply(logistic(affine_transform({a_o, h2o, h, c2o, c})), tanh(c));
+      }
+      running = columns.size();
+
+      for (unsigned j = 0; j < columns.size(); ++j) {
+        outputs[columns[j]] = (columns.size() == 1) ? h : colwise_select(h, {j});
+      }
+    }
+    inputs = concatenate_cols(outputs);
+  }
+  return outputs;
+}
+
+vector<vector<Expression>> SentimentModel::BuildLeafAnnotations(const vector<vector<WordId>>& sentences, ComputationGraph& cg) {
+  vector<vector<Expression>> annotations(sentences.size());
+  vector<Expression> embeddings;
+  vector<unsigned> lengths;
+  for (unsigned s = 0; s < sentences.size(); ++s) {
+    for (WordId word : sentences[s]) {
+      annotations[s].push_back(lookup(cg, p_E, word));
+      embeddings.push_back(annotations[s].back());
+    }
+    lengths.push_back(sentences[s].size());
+  }
+  if (leaf_encoder == LOOKUP_LEAVES || embeddings.size() == 0) {
+    return annotations;
+  }
+
+  // cnn runs a graph on one thread, so the two directions can't run at the
+  // same time here, but each is batched over all of the sentences
+  Expression inputs = concatenate_cols(embeddings);
+  vector<Expression> forward = RunBatchedLSTM(forward_builder, inputs, lengths, false, cg);
+  vector<Expression> reverse = RunBatchedLSTM(reverse_builder, inputs, lengths, true, cg);
+  unsigned column = 0;
+  for (unsigned s = 0; s < sentences.size(); ++s) {
+    for (unsigned t = 0; t < sentences[s].size(); ++t, ++column) {
+      annotations[s][t] = concatenate({forward[column], reverse[column]});
+    }
+  }
+  return annotations;
+}
+
+vector<Expression> SentimentModel::BuildLeafAnnotations(const vector<WordId>& terminals, ComputationGraph& cg, const vector<bool>* visible) {
+  assert (visible == nullptr || visible->size() == terminals.size());
+  vector<Expression> annotations = BuildLeafAnnotations(vector<vector<WordId>>{terminals}, cg)[0];
+  vector<Expression> linear_annotations;
+  for (unsigned i = 0; i < annotations.size(); ++i) {
+    if (visible == nullptr || (*visible)[i]) {
+      linear_annotations.push_back(annotations[i]);
+    }
+  }
+  return linear_annotations;
+}
+
+vector<Expression> SentimentModel::BuildLinearAnnotationVectors(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states) {
+  vector<WordId> terminals = tree.GetTerminals();
+  vector<bool> visible;
+  FindVisibleTerminals(tree, fixed_states, true, &visible);
+  return BuildLeafAnnotations(terminals, cg, &visible);
+}
+
+void SentimentModel::NewGraph(ComputationGraph& cg) {
+  tree_builder.new_graph(cg);
+}
+
+vector<tuple<SyntaxTree*, Expression>> SentimentModel::Predict(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states, const vector<bool>* selected_nodes) {
+  NewGraph(cg);
+  vector<Expression> linear_annotations = BuildLinearAnnotationVectors(tree, cg, fixed_states);
+  vector<Expression> tree_annotations = BuildTreeAnnotationVectors(tree, linear_annotations, cg, fixed_states);
+  assert (tree_annotations.size() == tree.id() + 1);
 
   vector<tuple<SyntaxTree*, Expression>> outputs;
   const MLP& final_mlp = GetFinalMLP(cg);
-  CalculateOutputs(tree, tree_annotations, final_mlp, cg, &outputs);
+  CalculateOutputs(tree, tree_annotations, final_mlp, cg, &outputs, fixed_states, selected_nodes);
   return outputs;
 }
 
-Expression SentimentModel::BuildGraph(const SyntaxTree& tree, ComputationGraph& cg) {
-  vector<tuple<SyntaxTree*, Expression>> outputs = Predict(tree, cg);
-  return CalculateLoss(outputs, cg);
+Expression SentimentModel::PredictBatched(const SyntaxTree& tree, ComputationGraph& cg, vector<SyntaxTree*>* nodes, const map<unsigned, NodeState>* fixed_states, const vector<bool>* selected_nodes) {
+  NewGraph(cg);
+  vector<Expression> linear_annotations = BuildLinearAnnotationVectors(tree, cg, fixed_states);
+  vector<Expression> tree_annotations = BuildTreeAnnotationVectors(tree, linear_annotations, cg, fixed_states);
+  assert (tree_annotations.size() == tree.id() + 1);
+
+  nodes->clear();
+  FindOutputNodes(tree, fixed_states, selected_nodes, nodes);
+  if (nodes->size() == 0) {
+    return Expression();
+  }
+
+  vector<Expression> node_annotations(nodes->size());
+  for (unsigned i = 0; i < nodes->size(); ++i) {
+    node_annotations[i] = tree_annotations[(*nodes)[i]->id()];
+  }
+  return CalculateBatchedOutputs(node_annotations, GetFinalMLP(cg));
 }
 
-vector<Expression> SentimentModel::BuildForwardAnnotations(const vector<WordId>& sentence, ComputationGraph& cg) {
-  forward_builder.new_graph(cg);
-  forward_builder.start_new_sequence();
-  vector<Expression> forward_annotations(sentence.size());
-  for (unsigned t = 0; t < sentence.size(); ++t) {
-    Expression i_x_t = lookup(cg, p_E, sentence[t]);
-    Expression i_y_t = forward_builder.add_input(i_x_t);
-    forward_annotations[t] = i_y_t;
+Expression SentimentModel::BuildGraph(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states, cnn::real weight) {
+  vector<SyntaxTree*> nodes;
+  Expression outputs = PredictBatched(tree, cg, &nodes, fixed_states);
+  vector<cnn::real> weights;
+  if (weight != 1.0) {
+    weights.assign(nodes.size(), weight);
   }
-  return forward_annotations;
+  return CalculateBatchedLoss(nodes, outputs, cg, weights);
 }
 
-vector<Expression> SentimentModel::BuildReverseAnnotations(const vector<WordId>& sentence, ComputationGraph& cg) {
-  reverse_builder.new_graph(cg);
-  reverse_builder.start_new_sequence();
-  vector<Expression> reverse_annotations(sentence.size());
-  for (unsigned t = sentence.size(); t > 0; ) {
-    t--;
-    Expression i_x_t = lookup(cg, p_E, sentence[t]);
-    Expression i_y_t = reverse_builder.add_input(i_x_t);
-    reverse_annotations[t] = i_y_t;
+TreePlan SentimentModel::PlanTree(const SyntaxTree& tree) {
+  TreePlan plan;
+  plan.terminals = tree.GetTerminals();
+  FindOutputNodes(tree, nullptr, nullptr, &plan.output_nodes);
+  for (const SyntaxTree* node : plan.output_nodes) {
+    plan.labels.push_back(node->sentiment());
   }
-  return reverse_annotations;
+  plan.node_count = tree.NumNodes();
+  return plan;
 }
 
-vector<Expression> SentimentModel::BuildAnnotationVectors(const vector<Expression>& forward_annotations, const vector<Expression>& reverse_annotations, ComputationGraph& cg) {
-  vector<Expression> annotations(forward_annotations.size());
-  for (unsigned t = 0; t < forward_annotations.size(); ++t) {
-    const Expression& i_f = forward_annotations[t];
-    const Expression& i_r = reverse_annotations[t];
-    Expression i_h = concatenate({i_f, i_r});
-    annotations[t] = i_h;
+Expression SentimentModel::BuildGraph(const SyntaxTree& tree, const TreePlan& plan, ComputationGraph& cg, cnn::real weight) {
+  NewGraph(cg);
+  vector<Expression> linear_annotations = BuildLeafAnnotations(plan.terminals, cg);
+  vector<Expression> tree_annotations = BuildTreeAnnotationVectors(tree, linear_annotations, cg);
+  if (plan.output_nodes.size() == 0) {
+    return input(cg, 0.0f);
+  }
+
+  vector<Expression> node_annotations(plan.output_nodes.size());
+  for (unsigned i = 0; i < plan.output_nodes.size(); ++i) {
+    node_annotations[i] = tree_annotations[plan.output_nodes[i]->id()];
   }
-  return annotations;
+  Expression outputs = CalculateBatchedOutputs(node_annotations, GetFinalMLP(cg));
+  vector<cnn::real> weights;
+  if (weight != 1.0) {
+    weights.assign(plan.labels.size(), weight);
+  }
+  return colwise_pickneglogsoftmax(outputs, plan.labels, weights);
 }
 
-vector<Expression> SentimentModel::BuildTreeAnnotationVectors(const SyntaxTree& source_tree, const vector<Expression>& linear_annotations, ComputationGraph& cg) {
-  tree_builder.new_graph(cg);
+vector<cnn::real> SentimentModel::SoftTargets(const vector<vector<cnn::real>>& scores, cnn::real temperature) {
+  vector<cnn::real> targets;
+  for (const vector<cnn::real>& column : scores) {
+    assert (column.size() > 0);
+    const cnn::real m = *max_element(column.begin(), column.end());
+    const unsigned start = targets.size();
+    cnn::real z = 0.0;
+    for (cnn::real score : column) {
+      targets.push_back(exp((score - m) / temperature));
+      z += targets.back();
+    }
+    for (unsigned k = start; k < targets.size(); ++k) {
+      targets[k] /= z;
+    }
+  }
+  return targets;
+}
+
+Expression SentimentModel::BuildDistillationGraph(const SyntaxTree& tree, const vector<cnn::real>& soft_targets, cnn::real temperature, cnn::real soft_weight, ComputationGraph& cg, cnn::real weight) {
+  vector<SyntaxTree*> nodes;
+  Expression outputs = PredictBatched(tree, cg, &nodes);
+  if (nodes.size() == 0) {
+    return input(cg, 0.0f);
+  }
+
+  Expression soft_loss = colwise_softmax_cross_entropy(outputs * (1.0f / temperature), nodes.size(), soft_targets) * (temperature * temperature * weight);
+  if (soft_weight >= 1.0) {
+    return soft_loss;
+  }
+  Expression hard_loss = CalculateBatchedLoss(nodes, outputs, cg);
+  return soft_loss * soft_weight + hard_loss * ((1.0f - soft_weight) * weight);
+}
+
+Expression SentimentModel::BuildBatchGraph(const vector<const SyntaxTree*>& trees, ComputationGraph& cg, const vector<cnn::real>* weights) {
+  assert (weights == nullptr || weights->size() == trees.size());
+  NewGraph(cg);
+  vector<vector<WordId>> sentences;
+  for (const SyntaxTree* tree : trees) {
+    sentences.push_back(tree->GetTerminals());
+  }
+  vector<vector<Expression>> leaf_annotations = BuildLeafAnnotations(sentences, cg);
+
+  vector<SyntaxTree*> nodes;
+  vector<cnn::real> node_weights;
+  vector<Expression> node_annotations;
+  for (unsigned t = 0; t < trees.size(); ++t) {
+    const SyntaxTree* tree = trees[t];
+    vector<Expression> tree_annotations = BuildTreeAnnotationVectors(*tree, leaf_annotations[t], cg);
+    vector<SyntaxTree*> tree_nodes;
+    FindOutputNodes(*tree, nullptr, nullptr, &tree_nodes);
+    for (SyntaxTree* node : tree_nodes) {
+      nodes.push_back(node);
+      node_annotations.push_back(tree_annotations[node->id()]);
+      if (weights != nullptr) {
+        node_weights.push_back((*weights)[t]);
+      }
+    }
+  }
+
+  if (nodes.size() == 0) {
+    return input(cg, 0.0f);
+  }
+  Expression outputs = CalculateBatchedOutputs(node_annotations, GetFinalMLP(cg));
+  return CalculateBatchedLoss(nodes, outputs, cg, node_weights);
+}
+
+vector<Expression> SentimentModel::BuildTreeAnnotationVectors(const SyntaxTree& source_tree, const vector<Expression>& linear_annotations, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states) {
   tree_builder.start_new_sequence();
   vector<Expression> annotations;
   vector<Expression> tree_annotations;
@@ -143,25 +511,48 @@ vector<Expression> SentimentModel::BuildTreeAnnotationVectors(const SyntaxTree&
     assert (node_stack.size() == index_stack.size());
     const SyntaxTree* node = node_stack.back();
     unsigned i = index_stack.back();
-    if (i >= node->NumChildren()) {
-      assert (tree_annotations.size() == node->id());
+    if (i == 0 && fixed_states != nullptr && fixed_states->count(node->id()) > 0) {
+      // Splice in the precomputed state instead of visiting this subtree.
+      // Ids inside the subtree are left as gaps.
+      const NodeState& state = fixed_states->at(node->id());
+      assert (state.h.size() == lstm_layer_count && state.c.size() == lstm_layer_count);
+      vector<Expression> node_h(lstm_layer_count);
+      vector<Expression> node_c(lstm_layer_count);
+      for (unsigned j = 0; j < lstm_layer_count; ++j) {
+        if (state.h_params.size() > 0) {
+          node_h[j] = parameter(cg, state.h_params[j]);
+          node_c[j] = parameter(cg, state.c_params[j]);
+        }
+        else {
+          node_h[j] = input(cg, {(long)state.h[j].size()}, &state.h[j]);
+          node_c[j] = input(cg, {(long)state.c[j].size()}, &state.c[j]);
+        }
+      }
+      tree_builder.set_state((int)node->id(), node_h, node_c);
+      tree_annotations.resize(node->id());
+      tree_annotations.push_back(node_h.back());
+      index_stack.pop_back();
+      node_stack.pop_back();
+    }
+    else if (i >= node->NumChildren()) {
+      assert (tree_annotations.size() <= node->id());
+      tree_annotations.resize(node->id());
       vector<int> children(node->NumChildren());
       for (unsigned j = 0; j < node->NumChildren(); ++j) {
         unsigned child_id = node->GetChild(j).id();
         assert (child_id < tree_annotations.size());
+        assert (tree_annotations[child_id].pg != nullptr);
         assert (child_id < (unsigned)INT_MAX);
         children[j] = (int)child_id;
       }
 
+      // Internal nodes have no input of their own
       Expression input_expr;
       if (node->NumChildren() == 0) {
         assert (terminal_index < linear_annotations.size());
         input_expr = linear_annotations[terminal_index];
         terminal_index++;
       }
-      else {
-        input_expr = input(cg, {(long)zero_annotation.size()}, &zero_annotation);
-      }
       Expression node_annotation = tree_builder.add_input((int)node->id(), children, input_expr);
       tree_annotations.push_back(node_annotation);
       index_stack.pop_back();
@@ -187,3 +578,36 @@ MLP SentimentModel::GetFinalMLP(ComputationGraph& cg) const {
   MLP final_mlp = {{i_fIH}, i_fHb, i_fHO, i_fOb};
   return final_mlp;
 }
+
+NodeState SentimentModel::GetNodeState(unsigned id) const {
+  assert (id < tree_builder.h.size());
+  NodeState state;
+  for (unsigned i = 0; i < lstm_layer_count; ++i) {
+    state.h.push_back(as_vector(tree_builder.h[id][i].value()));
+    state.c.push_back(as_vector(tree_builder.c[id][i].value()));
+  }
+  return state;
+}
+
+void SentimentModel::GetNodeStateExpressions(unsigned id, vector<Expression>* h, vector<Expression>* c) const {
+  assert (id < tree_builder.h.size());
+  *h = tree_builder.h[id];
+  *c = tree_builder.c[id];
+}
+
+size_t SentimentModel::EstimateGraphBytes(unsigned node_count) const {
+  // Each TreeLSTM layer creates around twenty hidden-sized vectors per node
+  // (gate pre-activations and activations, one forget gate per child, cell
+  // products), and the final MLP another two hidden layers and an output.
+  // Every value also gets a matching gradient in the backward pass.
+  size_t per_node = lstm_layer_count * 20 * node_embedding_dim + 2 * final_hidden_dim + 2 * 5 + word_embedding_dim;
+  // The leaf BiLSTM adds around fifteen half-sized vectors per word, layer
+  // and direction, plus each word's concatenated annotation
+  if (leaf_encoder == BILSTM_LEAVES) {
+    per_node += lstm_layer_count * 15 * node_embedding_dim + node_embedding_dim;
+  }
+  // Looked-up child transition matrices are shared across the whole graph
+  const size_t n = max_branching_factor;
+  const size_t tree_lstm_lookups = lstm_layer_count * (5 * n + 2 * n * n) * node_embedding_dim * node_embedding_dim;
+  return 2 * sizeof(cnn::real) * (tree_lstm_lookups + node_count * per_node);
+}
@@ -1,11 +1,16 @@
 #pragma once
 #include <vector>
+#include <map>
+#include <set>
 #include <boost/archive/text_oarchive.hpp>
+#include <boost/serialization/version.hpp>
 #include "cnn/cnn.h"
 #include "cnn/lstm.h"
 #include "treelstm.h"
 #include "syntax_tree.h"
 
+class PretrainedEmbeddings;
+
 using namespace std;
 using namespace cnn;
 using namespace cnn::expr;
@@ -17,26 +22,134 @@ struct MLP {
   Expression i_Ob;
 
   Expression Feed(vector<Expression> input) const;
+  // Like Feed(), but each input is a matrix with one example per column
+  Expression FeedBatch(vector<Expression> inputs) const;
+};
+
+// The values of a node's TreeLSTM h and c at every layer. These let a
+// subtree computed in one graph stand in for that subtree in another.
+struct NodeState {
+  vector<vector<cnn::real>> h;
+  vector<vector<cnn::real>> c;
+  // If set (one per layer), the state is read from these parameters rather
+  // than h and c, so the gradient reaching it can be read after backward()
+  vector<Parameters*> h_params;
+  vector<Parameters*> c_params;
+};
+
+// Which internal nodes need output distributions. By default, all of them.
+struct OutputSelection {
+  bool root_only = false;
+  unsigned min_span = 0; // Minimum number of terminals a node must cover
+  set<pair<unsigned, unsigned>> spans; // [start, end) terminal positions; empty means any span
+
+  bool SelectsAll() const;
+  // Returns whether each node of tree, indexed by id, is selected
+  vector<bool> SelectNodes(const SyntaxTree& tree) const;
+};
+
+// What training needs to know about a tree besides the tree itself, worked
+// out ahead of time so that it can be done off the thread running cnn
+struct TreePlan {
+  vector<WordId> terminals; // Embedding rows of the leaves, left to right
+  vector<SyntaxTree*> output_nodes; // Internal nodes, in post-order
+  vector<unsigned> labels; // Gold label of each output node
+  unsigned node_count;
+};
+
+// How the TreeLSTM's inputs at the leaves are computed from the words
+enum LeafEncoder {
+  LOOKUP_LEAVES, // Each word's embedding, on its own
+  BILSTM_LEAVES, // A bidirectional LSTM over the embeddings of the whole sentence
 };
 
+LeafEncoder ParseLeafEncoder(const string& name);
+
+// Splits the value of a matrix expression into its columns
+vector<vector<cnn::real>> ReadColumns(const Expression& matrix);
+
 class SentimentModel {
 public:
   SentimentModel();
   SentimentModel(Model& model, unsigned vocab_size);
+  // Sets the model's dimensions. InitializeParameters() must be called before use.
+  SentimentModel(unsigned word_embedding_dim, unsigned node_embedding_dim, unsigned final_hidden_dim, unsigned lstm_layer_count, unsigned max_branching_factor, LeafEncoder leaf_encoder = LOOKUP_LEAVES);
   void InitializeParameters(Model& model, unsigned vocab_size);
+  // Overwrites the embedding of each word in vocab that pretrained has a
+  // vector for, returning how many there were. Only those rows of
+  // pretrained are read. Its dimension must match word_embedding_dim.
+  unsigned InitializeEmbeddings(const PretrainedEmbeddings& pretrained, const Vocabulary& vocab);
+  unsigned WordEmbeddingDim() const;
+
+  // fixed_states optionally maps node ids to precomputed states. Those
+  // subtrees are not rebuilt, and produce no outputs or losses.
+  // selected_nodes optionally restricts outputs to the nodes whose ids it
+  // marks, as returned by OutputSelection::SelectNodes().
+  // A loss is multiplied by weight, e.g. the number of copies of the tree
+  // in the corpus, so that one pass stands in for all of them.
+  Expression BuildGraph(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states = nullptr, cnn::real weight = 1.0);
+  // The same, using a plan made by PlanTree(tree)
+  Expression BuildGraph(const SyntaxTree& tree, const TreePlan& plan, ComputationGraph& cg, cnn::real weight = 1.0);
+  // Doesn't touch cnn at all, so may be called from any thread
+  static TreePlan PlanTree(const SyntaxTree& tree);
+  // Builds the summed loss of several trees in one graph, with the final MLP
+  // and loss computed over all of their nodes at once. weights optionally
+  // gives each tree's weight.
+  Expression BuildBatchGraph(const vector<const SyntaxTree*>& trees, ComputationGraph& cg, const vector<cnn::real>* weights = nullptr);
+  Expression CalculateLoss(const vector<tuple<SyntaxTree*, Expression>>& results, ComputationGraph& cg, cnn::real weight = 1.0);
+  void CalculateOutputs(const SyntaxTree& tree, const vector<Expression>& annotations, const MLP& final_mlp, ComputationGraph& cg, vector<tuple<SyntaxTree*, Expression>>* results, const map<unsigned, NodeState>* fixed_states = nullptr, const vector<bool>* selected_nodes = nullptr);
+  vector<tuple<SyntaxTree*, Expression>> Predict(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states = nullptr, const vector<bool>* selected_nodes = nullptr);
+
+  // Batched versions of the above. The outputs of nodes are stacked as the
+  // columns of a single matrix, in the order given by nodes. If there are
+  // no nodes, the returned expression is empty.
+  Expression PredictBatched(const SyntaxTree& tree, ComputationGraph& cg, vector<SyntaxTree*>* nodes, const map<unsigned, NodeState>* fixed_states = nullptr, const vector<bool>* selected_nodes = nullptr);
+  Expression CalculateBatchedOutputs(const vector<Expression>& node_annotations, const MLP& final_mlp);
+  // weights holds one weight per node, or is empty to weight them all by one
+  Expression CalculateBatchedLoss(const vector<SyntaxTree*>& nodes, const Expression& outputs, ComputationGraph& cg, const vector<cnn::real>& weights = {});
 
-  Expression BuildGraph(const SyntaxTree& tree, ComputationGraph& cg);
-  Expression CalculateLoss(const vector<tuple<SyntaxTree*, Expression>>& results, ComputationGraph& cg);
-  void CalculateOutputs(const SyntaxTree& tree, const vector<Expression>& annotations, const MLP& final_mlp, ComputationGraph& cg, vector<tuple<SyntaxTree*, Expression>>* results);
-  vector<tuple<SyntaxTree*, Expression>> Predict(const SyntaxTree& tree, ComputationGraph& cg);
-  vector<Expression> BuildForwardAnnotations(const vector<WordId>& sentence, ComputationGraph& cg);
-  vector<Expression> BuildReverseAnnotations(const vector<WordId>& sentence, ComputationGraph& cg);
-  vector<Expression> BuildAnnotationVectors(const vector<Expression>& forward_annotations, const vector<Expression>& reverse_annotations, ComputationGraph& cg);
-  vector<Expression> BuildLinearAnnotationVectors(const SyntaxTree& tree, ComputationGraph& cg);
-  vector<Expression> BuildTreeAnnotationVectors(const SyntaxTree& source_tree, const vector<Expression>& linear_annotations, ComputationGraph& cg);
+  // Turns each output node's scores, as returned by ReadColumns(), into a
+  // distribution over labels at the given temperature, stacked column-major
+  static vector<cnn::real> SoftTargets(const vector<vector<cnn::real>>& scores, cnn::real temperature);
+  // Builds a knowledge distillation loss: soft_weight times the cross
+  // entropy against soft_targets at the given temperature (scaled by the
+  // temperature squared, so that its gradients don't shrink as the
+  // temperature grows), plus 1 - soft_weight times the usual loss. The
+  // total is multiplied by weight, as in BuildGraph().
+  Expression BuildDistillationGraph(const SyntaxTree& tree, const vector<cnn::real>& soft_targets, cnn::real temperature, cnn::real soft_weight, ComputationGraph& cg, cnn::real weight = 1.0);
+  // Must be called once per graph before building any annotations in it
+  void NewGraph(ComputationGraph& cg);
+  // Returns an annotation for each terminal, or only for those marked in visible if given
+  vector<Expression> BuildLeafAnnotations(const vector<WordId>& terminals, ComputationGraph& cg, const vector<bool>* visible = nullptr);
+  // Returns the annotations of several sentences' terminals, computing the
+  // leaf encoder for all of them together
+  vector<vector<Expression>> BuildLeafAnnotations(const vector<vector<WordId>>& sentences, ComputationGraph& cg);
+  // Returns one annotation per terminal that is not inside a fixed subtree
+  vector<Expression> BuildLinearAnnotationVectors(const SyntaxTree& tree, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states = nullptr);
+  vector<Expression> BuildTreeAnnotationVectors(const SyntaxTree& source_tree, const vector<Expression>& linear_annotations, ComputationGraph& cg, const map<unsigned, NodeState>* fixed_states = nullptr);
 
   MLP GetFinalMLP(ComputationGraph& cg) const;
 
+  // Reads back the state of a node after the graph that built it has been run forward
+  NodeState GetNodeState(unsigned id) const;
+  // The expressions holding a node's state in the current graph
+  void GetNodeStateExpressions(unsigned id, vector<Expression>* h, vector<Expression>* c) const;
+
+  // Rough size of the forward and backward values of a graph over a tree
+  // with node_count nodes. The model's own parameters are not included;
+  // see ParameterBytes() in memory.h.
+  size_t EstimateGraphBytes(unsigned node_count) const;
+
+  // Dimension of the inputs the TreeLSTM receives at the leaves
+  unsigned LeafAnnotationDim() const;
+  // Whether a subtree's state depends on words outside of it, in which
+  // case states can't be reused from one sentence in another
+  bool HasContextualLeaves() const;
+  // The rows of each lookup parameter that a graph over trees may read:
+  // their words' embeddings, and all of the TreeLSTM's rows, which are
+  // indexed by child position and so are few
+  vector<pair<LookupParameters*, vector<unsigned>>> LookupRows(const vector<const SyntaxTree*>& trees) const;
+
 private:
   LSTMBuilder forward_builder;
   LSTMBuilder reverse_builder;
@@ -47,18 +160,26 @@ private:
   Parameters* p_fHO;
   Parameters* p_fOb;
 
-  vector<cnn::real> zero_annotation;
-
   unsigned lstm_layer_count = 1;
   unsigned word_embedding_dim = 50;
   unsigned node_embedding_dim = 50;
   unsigned final_hidden_dim = 50;
+  unsigned max_branching_factor = 5;
+  LeafEncoder leaf_encoder = LOOKUP_LEAVES;
 
+  friend class NativeEvaluator;
   friend class boost::serialization::access;
-  template<class Archive> void serialize(Archive& ar, const unsigned int) {
+  template<class Archive> void serialize(Archive& ar, const unsigned int version) {
     ar & lstm_layer_count;
     ar & word_embedding_dim;
     ar & node_embedding_dim;
     ar & final_hidden_dim;
+    if (version >= 1) {
+      ar & max_branching_factor;
+    }
+    if (version >= 2) {
+      ar & leaf_encoder;
+    }
   }
 };
+BOOST_CLASS_VERSION(SentimentModel, 2)
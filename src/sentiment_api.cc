@@ -0,0 +1,218 @@
+#include "cnn/cnn.h"
+
+#include <cctype>
+#include <mutex>
+#include <stdexcept>
+#include <algorithm>
+
+#include "sentiment_api.h"
+#include "model_io.h"
+#include "native_evaluator.h"
+#include "work_stealing.h"
+
+namespace sentiment_api {
+
+// cnn keeps global state, so models are loaded one at a time
+static mutex load_lock;
+static bool cnn_initialized = false;
+
+ScoringModel::ScoringModel() : unk_id(-1) {}
+
+ScoringModel::~ScoringModel() {}
+
+shared_ptr<const ScoringModel> ScoringModel::Load(const string& filename) {
+  lock_guard<mutex> guard(load_lock);
+  if (!cnn_initialized) {
+    char name[] = "sentiment_api";
+    char* args[] = {name, nullptr};
+    int argc = 1;
+    char** argv = args;
+    cnn::Initialize(argc, argv);
+    cnn_initialized = true;
+  }
+
+  Vocabulary* vocab = nullptr;
+  Model* cnn_model = nullptr;
+  SentimentModel* sentiment_model = nullptr;
+  try {
+    tie(vocab, cnn_model, sentiment_model) = ReadModel(filename);
+  }
+  catch (const runtime_error&) {
+    return nullptr;
+  }
+  shared_ptr<ScoringModel> model(new ScoringModel());
+  model->vocab.reset(vocab);
+  model->evaluator.reset(new NativeEvaluator(*sentiment_model));
+  model->unk_id = vocab->Contains("UNK") ? vocab->Lookup("UNK", 3) : -1;
+  // The evaluator has its own copy of every weight
+  delete sentiment_model;
+  delete cnn_model;
+  return model;
+}
+
+int ScoringModel::WordId(const string& word) const {
+  const int id = vocab->Lookup(word.c_str(), word.length());
+  return (id >= 0) ? id : unk_id;
+}
+
+unsigned ScoringModel::vocab_size() const {
+  return vocab->size();
+}
+
+ScoringContext::ScoringContext(shared_ptr<const ScoringModel> model, unsigned num_threads) : model(model), pool(new WorkStealingPool(max(num_threads, 1U))) {}
+
+ScoringContext::~ScoringContext() {}
+
+// Skips past the tree starting at text[*pos], returning false if it isn't
+// in the bracketed format SyntaxTree reads, which asserts on anything else:
+// a numeric label and a space, then either one word or subtrees separated
+// by single spaces, then a closing parenthesis
+static bool SkipTree(const string& text, size_t* pos) {
+  size_t i = *pos;
+  if (i >= text.length() || text[i] != '(') {
+    return false;
+  }
+  const size_t label_start = ++i;
+  while (i < text.length() && isdigit((unsigned char)text[i])) {
+    ++i;
+  }
+  if (i == label_start || i >= text.length() || text[i] != ' ') {
+    return false;
+  }
+  ++i;
+  if (i < text.length() && text[i] == '(') {
+    while (SkipTree(text, &i) && i < text.length() && text[i] == ' ') {
+      ++i;
+    }
+  }
+  else {
+    const size_t word_start = i;
+    while (i < text.length() && text[i] != '(' && text[i] != ')' && text[i] != ' ') {
+      ++i;
+    }
+    if (i == word_start) {
+      return false;
+    }
+  }
+  if (i >= text.length() || text[i] != ')') {
+    return false;
+  }
+  *pos = i + 1;
+  return true;
+}
+
+bool ScoringContext::Parse(const string& text, SyntaxTree* tree) const {
+  size_t end = 0;
+  if (!SkipTree(text, &end) || end != text.length()) {
+    return false;
+  }
+  // The vocabulary is frozen, so reading a tree only looks words up
+  try {
+    *tree = SyntaxTree(text, model->vocab.get());
+  }
+  catch (const runtime_error&) {
+    return false;
+  }
+  return true;
+}
+
+bool ScoringContext::Parse(const IdTree& source, SyntaxTree* tree) const {
+  if (source.children.size() == 0) {
+    if (source.word < 0 || (unsigned)source.word >= model->vocab->size()) {
+      return false;
+    }
+    *tree = SyntaxTree(source.word, model->vocab.get());
+    return true;
+  }
+  vector<SyntaxTree> children(source.children.size());
+  for (unsigned i = 0; i < children.size(); ++i) {
+    if (!Parse(source.children[i], &children[i])) {
+      return false;
+    }
+  }
+  *tree = SyntaxTree(source.sentiment, move(children), model->vocab.get());
+  return true;
+}
+
+// Finds the terminals covered by each node of tree, indexed by id
+static unsigned FindSpans(const SyntaxTree& tree, unsigned start, vector<pair<unsigned, unsigned>>* spans) {
+  unsigned end = start + (tree.IsTerminal() ? 1 : 0);
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    end = FindSpans(tree.GetChild(i), end, spans);
+  }
+  (*spans)[tree.id()] = make_pair(start, end);
+  return end;
+}
+
+void ScoringContext::Evaluate(SyntaxTree& tree, WorkStealingPool* pool, vector<NodeScores>* scores) const {
+  tree.AssignNodeIds();
+  vector<pair<unsigned, unsigned>> spans(tree.id() + 1);
+  FindSpans(tree, 0, &spans);
+
+  scores->clear();
+  for (const auto& prediction : model->evaluator->Predict(tree, nullptr, pool)) {
+    const SyntaxTree* node = get<0>(prediction);
+    NodeScores node_scores;
+    node_scores.start = spans[node->id()].first;
+    node_scores.end = spans[node->id()].second;
+    node_scores.sentiment = node->sentiment();
+    node_scores.scores = get<1>(prediction);
+    node_scores.label = max_element(node_scores.scores.begin(), node_scores.scores.end()) - node_scores.scores.begin();
+    scores->push_back(node_scores);
+  }
+}
+
+bool ScoringContext::Score(const string& text, vector<NodeScores>* scores) {
+  SyntaxTree tree;
+  scores->clear();
+  if (!Parse(text, &tree)) {
+    return false;
+  }
+  Evaluate(tree, pool.get(), scores);
+  return true;
+}
+
+bool ScoringContext::Score(const IdTree& source, vector<NodeScores>* scores) {
+  SyntaxTree tree;
+  scores->clear();
+  if (!Parse(source, &tree)) {
+    return false;
+  }
+  Evaluate(tree, pool.get(), scores);
+  return true;
+}
+
+// Scores each tree as one task, serially within the tree
+template<class Input> bool ScoringContext::ScoreAll(const vector<Input>& trees, vector<vector<NodeScores>>* scores) {
+  scores->assign(trees.size(), vector<NodeScores>());
+  unique_ptr<bool[]> succeeded(new bool[trees.size()]);
+  vector<WorkStealingPool::Task> tasks;
+  for (unsigned i = 0; i < trees.size(); ++i) {
+    tasks.push_back([&, i] {
+      SyntaxTree tree;
+      succeeded[i] = Parse(trees[i], &tree);
+      if (succeeded[i]) {
+        Evaluate(tree, nullptr, &(*scores)[i]);
+      }
+    });
+  }
+  if (pool->size() > 1) {
+    pool->Run(tasks);
+  }
+  else {
+    for (const WorkStealingPool::Task& task : tasks) {
+      task();
+    }
+  }
+  return all_of(succeeded.get(), succeeded.get() + trees.size(), [](bool b) { return b; });
+}
+
+bool ScoringContext::ScoreBatch(const vector<string>& trees, vector<vector<NodeScores>>* scores) {
+  return ScoreAll(trees, scores);
+}
+
+bool ScoringContext::ScoreBatch(const vector<IdTree>& trees, vector<vector<NodeScores>>* scores) {
+  return ScoreAll(trees, scores);
+}
+
+} // namespace sentiment_api
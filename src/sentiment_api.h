@@ -0,0 +1,90 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+
+class NativeEvaluator;
+class SyntaxTree;
+class Vocabulary;
+class WorkStealingPool;
+
+// An interface for scoring trees from other programs, built into
+// bin/libsentiment.a. A loaded model never changes, so one can be shared
+// by any number of threads, each scoring through its own context, and no
+// lock is shared between contexts.
+namespace sentiment_api {
+
+// A tree whose terminals are already word ids, from ScoringModel::WordId().
+// It has the same shape as the bracketed trees, so each word is normally
+// the only child of a preterminal.
+struct IdTree {
+  int word = -1; // Terminals only
+  unsigned sentiment = 0; // Internal nodes only; passed through to the output
+  std::vector<IdTree> children;
+};
+
+// The scores of one internal node. Nodes come in post-order.
+struct NodeScores {
+  unsigned start, end; // Terminals covered, end exclusive
+  unsigned sentiment; // The node's label in the input tree
+  unsigned label; // The highest scoring label
+  std::vector<float> scores;
+};
+
+class ScoringModel {
+public:
+  // Loads a model written by train. Returns nullptr if the file can't be
+  // opened or isn't a valid model file. Loading goes through cnn, so it is
+  // serialized internally.
+  static std::shared_ptr<const ScoringModel> Load(const std::string& filename);
+  ~ScoringModel();
+
+  // Returns word's id, which is UNK's id if the model has UNK and doesn't
+  // know word, or else -1
+  int WordId(const std::string& word) const;
+  unsigned vocab_size() const;
+
+private:
+  ScoringModel();
+
+  std::unique_ptr<Vocabulary> vocab;
+  std::unique_ptr<NativeEvaluator> evaluator;
+  int unk_id;
+
+  friend class ScoringContext;
+};
+
+// Scratch state for scoring on one thread. Contexts are cheap, and each
+// one must only be used by one thread at a time.
+class ScoringContext {
+public:
+  // With num_threads > 1, the context runs its own threads: a single
+  // tree's independent subtrees are scored in parallel, and a batch's
+  // trees are spread across the threads.
+  explicit ScoringContext(std::shared_ptr<const ScoringModel> model, unsigned num_threads = 1);
+  ~ScoringContext();
+  ScoringContext(const ScoringContext&) = delete;
+  ScoringContext& operator=(const ScoringContext&) = delete;
+
+  // Scores a tree in the usual bracketed format. Returns false if it isn't
+  // well formed, or if it holds a word the model doesn't know and the model
+  // has no UNK.
+  bool Score(const std::string& tree, std::vector<NodeScores>* scores);
+  // Returns false if the tree has a terminal without a valid word id
+  bool Score(const IdTree& tree, std::vector<NodeScores>* scores);
+  // The same for several trees at once. Returns false if any tree fails,
+  // in which case that tree's scores are left empty.
+  bool ScoreBatch(const std::vector<std::string>& trees, std::vector<std::vector<NodeScores>>* scores);
+  bool ScoreBatch(const std::vector<IdTree>& trees, std::vector<std::vector<NodeScores>>* scores);
+
+private:
+  bool Parse(const std::string& text, SyntaxTree* tree) const;
+  bool Parse(const IdTree& source, SyntaxTree* tree) const;
+  void Evaluate(SyntaxTree& tree, WorkStealingPool* pool, std::vector<NodeScores>* scores) const;
+  template<class Input> bool ScoreAll(const std::vector<Input>& trees, std::vector<std::vector<NodeScores>>* scores);
+
+  const std::shared_ptr<const ScoringModel> model;
+  std::unique_ptr<WorkStealingPool> pool;
+};
+
+} // namespace sentiment_api
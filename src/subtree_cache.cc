@@ -0,0 +1,188 @@
+#include <cassert>
+#include "subtree_cache.h"
+
+SubtreeCache::SubtreeCache(size_t capacity) : capacity_(capacity), hits_(0), misses_(0) {}
+
+shared_ptr<const CachedSubtree> SubtreeCache::Lookup(uint64_t key) {
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(key);
+  if (it == index.end()) {
+    misses_++;
+    return nullptr;
+  }
+  hits_++;
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->second;
+}
+
+void SubtreeCache::Insert(uint64_t key, shared_ptr<const CachedSubtree> value) {
+  if (capacity_ == 0) {
+    return;
+  }
+
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(key);
+  if (it != index.end()) {
+    it->second->second = value;
+    entries.splice(entries.begin(), entries, it->second);
+    return;
+  }
+
+  if (entries.size() >= capacity_) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+  entries.push_front(make_pair(key, value));
+  index[key] = entries.begin();
+}
+
+size_t SubtreeCache::size() const {
+  lock_guard<mutex> guard(lock);
+  return entries.size();
+}
+
+size_t SubtreeCache::capacity() const {
+  return capacity_;
+}
+
+uint64_t SubtreeCache::hits() const {
+  return hits_;
+}
+
+uint64_t SubtreeCache::misses() const {
+  return misses_;
+}
+
+double SubtreeCache::hit_rate() const {
+  uint64_t lookups = hits_ + misses_;
+  return (lookups > 0) ? (double)hits_ / lookups : 0.0;
+}
+
+// The splitmix64 finalizer
+static uint64_t Mix(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+static uint64_t HashSubtrees(const SyntaxTree& tree, vector<uint64_t>* hashes) {
+  uint64_t h;
+  if (tree.IsTerminal()) {
+    h = Mix(0x9e3779b97f4a7c15ULL + (uint32_t)tree.label());
+  }
+  else {
+    h = Mix(0x7f4a7c159e3779b9ULL + tree.NumChildren());
+    for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+      h = Mix(h * 31 + HashSubtrees(tree.GetChild(i), hashes));
+    }
+  }
+  assert (tree.id() < hashes->size());
+  (*hashes)[tree.id()] = h;
+  return h;
+}
+
+vector<uint64_t> HashSubtrees(const SyntaxTree& tree) {
+  vector<uint64_t> hashes(tree.id() + 1);
+  HashSubtrees(tree, &hashes);
+  return hashes;
+}
+
+// Appends the internal nodes of tree in post-order
+static void FindInternalNodes(const SyntaxTree& tree, vector<const SyntaxTree*>* nodes) {
+  if (tree.IsTerminal()) {
+    return;
+  }
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    FindInternalNodes(tree.GetChild(i), nodes);
+  }
+  nodes->push_back(&tree);
+}
+
+// Adds every subtree that was built in the current graph to the cache
+static void CacheComputedSubtrees(const SyntaxTree& tree, const SentimentModel& model, const vector<uint64_t>& hashes, const vector<vector<cnn::real>>& outputs, const map<unsigned, NodeState>& fixed_states, SubtreeCache& cache) {
+  if (fixed_states.count(tree.id()) > 0) {
+    return;
+  }
+  for (unsigned i = 0; i < tree.NumChildren(); ++i) {
+    CacheComputedSubtrees(tree.GetChild(i), model, hashes, outputs, fixed_states, cache);
+  }
+
+  shared_ptr<CachedSubtree> entry = make_shared<CachedSubtree>();
+  entry->node_count = tree.NumNodes();
+  entry->state = model.GetNodeState(tree.id());
+  entry->output = outputs[tree.id()];
+  cache.Insert(hashes[tree.id()], entry);
+}
+
+// Looks up node's subtree, filling in the outputs of its internal nodes.
+// Returns nullptr if the entry of node or of any internal node below it
+// is missing.
+static shared_ptr<const CachedSubtree> LookupSubtree(const SyntaxTree& node, const vector<uint64_t>& hashes, SubtreeCache& cache, vector<vector<cnn::real>>* outputs) {
+  shared_ptr<const CachedSubtree> entry = cache.Lookup(hashes[node.id()]);
+  if (entry == nullptr || entry->node_count != node.NumNodes()) {
+    return nullptr;
+  }
+  for (unsigned i = 0; i < node.NumChildren(); ++i) {
+    const SyntaxTree& child = node.GetChild(i);
+    if (!child.IsTerminal() && LookupSubtree(child, hashes, cache, outputs) == nullptr) {
+      return nullptr;
+    }
+  }
+  if (!node.IsTerminal()) {
+    (*outputs)[node.id()] = entry->output;
+  }
+  return entry;
+}
+
+vector<tuple<SyntaxTree*, vector<cnn::real>>> PredictCached(SentimentModel& model, const SyntaxTree& tree, SubtreeCache& cache, GraphMemoryMonitor* monitor, const vector<bool>* selected_nodes) {
+  vector<uint64_t> hashes = HashSubtrees(tree);
+  vector<vector<cnn::real>> outputs(tree.id() + 1);
+
+  // Find the largest subtrees that are already in the cache
+  map<unsigned, NodeState> fixed_states;
+  vector<const SyntaxTree*> node_stack = {&tree};
+  while (node_stack.size() > 0) {
+    const SyntaxTree* node = node_stack.back();
+    node_stack.pop_back();
+    shared_ptr<const CachedSubtree> entry = LookupSubtree(*node, hashes, cache, &outputs);
+    if (entry != nullptr) {
+      fixed_states[node->id()] = entry->state;
+    }
+    else {
+      for (unsigned i = 0; i < node->NumChildren(); ++i) {
+        node_stack.push_back(&node->GetChild(i));
+      }
+    }
+  }
+
+  if (fixed_states.count(tree.id()) == 0) {
+    ComputationGraph cg;
+    vector<SyntaxTree*> nodes;
+    Expression predictions = model.PredictBatched(tree, cg, &nodes, &fixed_states);
+    cg.forward();
+    if (monitor != nullptr) {
+      monitor->Observe();
+    }
+
+    if (nodes.size() > 0) {
+      vector<vector<cnn::real>> columns = ReadColumns(predictions);
+      for (unsigned i = 0; i < nodes.size(); ++i) {
+        outputs[nodes[i]->id()] = columns[i];
+      }
+    }
+    CacheComputedSubtrees(tree, model, hashes, outputs, fixed_states, cache);
+  }
+
+  vector<const SyntaxTree*> internal_nodes;
+  FindInternalNodes(tree, &internal_nodes);
+  vector<tuple<SyntaxTree*, vector<cnn::real>>> results;
+  for (const SyntaxTree* node : internal_nodes) {
+    if (selected_nodes == nullptr || (*selected_nodes)[node->id()]) {
+      results.push_back(make_tuple((SyntaxTree*)node, outputs[node->id()]));
+    }
+  }
+  return results;
+}
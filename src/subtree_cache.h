@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <list>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include "sentiment.h"
+#include "memory.h"
+#include "syntax_tree.h"
+
+using namespace std;
+
+// What the model computes for the root of one subtree: its state, and its
+// output distribution if it's an internal node. Nodes below the root have
+// entries of their own, so every entry is the same small size.
+struct CachedSubtree {
+  unsigned node_count;
+  NodeState state;
+  vector<cnn::real> output;
+};
+
+// A bounded, thread-safe, least-recently-used map from subtree hashes to
+// the model's encodings of those subtrees.
+class SubtreeCache {
+public:
+  explicit SubtreeCache(size_t capacity);
+
+  shared_ptr<const CachedSubtree> Lookup(uint64_t key);
+  void Insert(uint64_t key, shared_ptr<const CachedSubtree> value);
+
+  size_t size() const;
+  size_t capacity() const;
+  uint64_t hits() const;
+  uint64_t misses() const;
+  double hit_rate() const;
+
+private:
+  typedef list<pair<uint64_t, shared_ptr<const CachedSubtree>>> Entries;
+  size_t capacity_;
+  Entries entries; // Most recently used first
+  unordered_map<uint64_t, Entries::iterator> index;
+  mutable mutex lock;
+  atomic<uint64_t> hits_;
+  atomic<uint64_t> misses_;
+};
+
+// Computes a hash of each node's subtree, indexed by node id. The hash
+// covers the words and the shape of the subtree but not its node labels,
+// which the model never looks at.
+vector<uint64_t> HashSubtrees(const SyntaxTree& tree);
+
+// Like Predict(), but reuses cached encodings of any subtrees seen before
+// and adds the subtrees it had to compute to the cache. A subtree is only
+// reused while the entries of all of its internal nodes are cached, since
+// their outputs are needed too. Only valid for models whose leaf encodings
+// do not depend on the rest of the sentence.
+// Cache entries must be complete, so selected_nodes only filters what is
+// returned, and does not save any work on subtrees that are not cached.
+vector<tuple<SyntaxTree*, vector<cnn::real>>> PredictCached(SentimentModel& model, const SyntaxTree& tree, SubtreeCache& cache, GraphMemoryMonitor* monitor, const vector<bool>* selected_nodes = nullptr);
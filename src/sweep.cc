@@ -0,0 +1,449 @@
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/program_options.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <csignal>
+#include <cerrno>
+#include <ctime>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <map>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sentiment.h"
+#include "memory.h"
+#include "corpus.h"
+#include "train.h"
+#include "training_loop.h"
+
+using namespace cnn;
+using namespace std;
+namespace po = boost::program_options;
+
+// One point in the sweep's grid
+struct SweepConfig {
+  string optimizer; // A CreateTrainer() learner, e.g. "adam" or "momentum:0.9"
+  double learning_rate;
+  unsigned word_dim;
+  unsigned node_dim;
+  unsigned hidden_dim;
+  unsigned batch_size;
+};
+
+enum SweepStatus {
+  SWEEP_PENDING,
+  SWEEP_RUNNING,
+  SWEEP_FINISHED,
+  SWEEP_STOPPED_EARLY, // Could not keep up with the best configuration
+  SWEEP_OUT_OF_TIME,   // Used up its CPU budget
+  SWEEP_INTERRUPTED,   // Ctrl-c was pressed
+  SWEEP_FAILED,        // The worker died
+};
+
+// What a worker reports back to the driver
+struct SweepResult {
+  SweepStatus status;
+  unsigned epochs;
+  unsigned best_epoch;
+  double best_dev_perp;
+  double cpu_seconds;
+};
+
+// Lives in memory shared by the driver and every worker. best_by_epoch[e]
+// is the lowest dev perplexity any worker has reached within e + 1 epochs.
+struct SweepBoard {
+  pthread_mutex_t lock;
+  unsigned max_epochs;
+  unsigned config_count;
+
+  double* best_by_epoch() { return reinterpret_cast<double*>(this + 1); }
+  SweepResult* results() { return reinterpret_cast<SweepResult*>(best_by_epoch() + max_epochs); }
+
+  static size_t Bytes(unsigned max_epochs, unsigned config_count) {
+    return sizeof(SweepBoard) + max_epochs * sizeof(double) + config_count * sizeof(SweepResult);
+  }
+};
+
+SweepBoard* CreateBoard(unsigned max_epochs, unsigned config_count) {
+  const size_t bytes = SweepBoard::Bytes(max_epochs, config_count);
+  void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    cerr << "ERROR: Unable to allocate shared memory for the sweep" << endl;
+    exit(1);
+  }
+  SweepBoard* board = static_cast<SweepBoard*>(memory);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&board->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  board->max_epochs = max_epochs;
+  board->config_count = config_count;
+  fill(board->best_by_epoch(), board->best_by_epoch() + max_epochs, numeric_limits<double>::infinity());
+  for (unsigned i = 0; i < config_count; ++i) {
+    board->results()[i] = {SWEEP_PENDING, 0, 0, numeric_limits<double>::infinity(), 0.0};
+  }
+  return board;
+}
+
+// Records a worker's best perplexity after epoch (counting from 0) and
+// returns the best any worker has managed by then, including this one
+double PostResult(SweepBoard* board, unsigned epoch, double best_dev_perp) {
+  pthread_mutex_lock(&board->lock);
+  double* best = board->best_by_epoch();
+  for (unsigned e = epoch; e < board->max_epochs; ++e) {
+    best[e] = min(best[e], best_dev_perp);
+  }
+  double result = best[epoch];
+  pthread_mutex_unlock(&board->lock);
+  return result;
+}
+
+template<class T> vector<T> ParseList(const string& name, const string& list) {
+  vector<T> values;
+  stringstream ss(list);
+  for (string item; getline(ss, item, ',');) {
+    stringstream item_stream(item);
+    T value;
+    if (!(item_stream >> value)) {
+      cerr << "ERROR: Invalid value \"" << item << "\" for " << name << endl;
+      exit(1);
+    }
+    values.push_back(value);
+  }
+  if (values.size() == 0) {
+    cerr << "ERROR: " << name << " is empty" << endl;
+    exit(1);
+  }
+  return values;
+}
+
+// Builds the options CreateTrainer() would have seen had config been given to train
+po::variables_map OptimizerArguments(const SweepConfig& config, const po::variables_map& sweep_vm) {
+  vector<string> args;
+  size_t colon = config.optimizer.find(':');
+  const string learner = config.optimizer.substr(0, colon);
+  args.push_back("--" + learner);
+  if (colon != string::npos) {
+    args.push_back(config.optimizer.substr(colon + 1));
+  }
+  args.push_back(learner == "adam" ? "--alpha" : "--learning_rate");
+  args.push_back(to_string(config.learning_rate));
+  args.push_back("--regularization");
+  args.push_back(to_string(sweep_vm["regularization"].as<double>()));
+  args.push_back("--eta_decay");
+  args.push_back(to_string(sweep_vm["eta_decay"].as<double>()));
+  if (sweep_vm.count("no_clipping")) {
+    args.push_back("--no_clipping");
+  }
+  if (sweep_vm.count("lazy_updates")) {
+    args.push_back("--lazy_updates");
+  }
+
+  po::variables_map vm;
+  try {
+    po::store(po::command_line_parser(args).options(OptimizerOptions()).run(), vm);
+  }
+  catch (const po::error& e) {
+    cerr << "ERROR: Invalid optimizer \"" << config.optimizer << "\": " << e.what() << endl;
+    exit(1);
+  }
+  po::notify(vm);
+  return vm;
+}
+
+string Describe(const SweepConfig& config) {
+  stringstream ss;
+  ss << config.optimizer << " lr=" << config.learning_rate << " dims=" << config.word_dim << "/" << config.node_dim << "/" << config.hidden_dim << " batch=" << config.batch_size;
+  return ss.str();
+}
+
+double CpuSeconds() {
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Trains one configuration in a forked worker, reporting to board->results()[index]
+void RunWorker(unsigned index, const SweepConfig& config, const vector<SyntaxTree>& training_set, const vector<SyntaxTree>& dev_set, Vocabulary& vocab, SweepBoard* board, const po::variables_map& vm) {
+  const unsigned max_epochs = board->max_epochs;
+  const unsigned grace_epochs = vm["grace_epochs"].as<unsigned>();
+  const double stop_margin = vm["stop_margin"].as<double>();
+  const double cpu_budget = vm["worker_cpu_seconds"].as<double>();
+  const string model_prefix = vm.count("model_prefix") ? vm["model_prefix"].as<string>() : "";
+  SweepResult& result = board->results()[index];
+  const double start_seconds = CpuSeconds();
+
+  SentimentModel sentiment_model(config.word_dim, config.node_dim, config.hidden_dim, vm["layers"].as<unsigned>(), vm["branching"].as<unsigned>(), ParseLeafEncoder(vm["leaf_encoder"].as<string>()));
+  Model cnn_model;
+  sentiment_model.InitializeParameters(cnn_model, vocab.size());
+  Trainer* sgd = CreateTrainer(cnn_model, OptimizerArguments(config, vm));
+  TreeLimits limits;
+  const unsigned max_nodes = MaxTreeNodes(limits, sentiment_model);
+  GraphMemoryMonitor memory_monitor;
+
+  vector<unsigned> order(training_set.size());
+  iota(order.begin(), order.end(), 0);
+  result.status = SWEEP_RUNNING;
+  for (unsigned epoch = 0; epoch < max_epochs; ++epoch) {
+    random_shuffle(order.begin(), order.end());
+    unsigned minibatch_count = 0;
+    unsigned node_count = 0;
+    unsigned oversize_count = 0;
+    for (unsigned i = 0; i < order.size(); ++i) {
+      CatchUpRows(sgd, sentiment_model, {&training_set[order[i]]});
+      ProcessTree(training_set[order[i]], sentiment_model, limits, max_nodes, true, memory_monitor, &node_count, &oversize_count);
+      if (++minibatch_count == config.batch_size) {
+        sgd->update(1.0 / config.batch_size);
+        minibatch_count = 0;
+      }
+      if (ctrlc_pressed) {
+        break;
+      }
+    }
+    if (ctrlc_pressed) {
+      result.status = SWEEP_INTERRUPTED;
+      break;
+    }
+    if (minibatch_count > 0) {
+      sgd->update(1.0 / config.batch_size);
+    }
+    FlushTrainer(sgd);
+
+    auto dev_loss = ComputeLoss(dev_set, sentiment_model, limits, max_nodes, memory_monitor);
+    const double dev_perp = exp(dev_loss.first / dev_loss.second);
+    result.epochs = epoch + 1;
+    if (dev_perp < result.best_dev_perp) {
+      result.best_dev_perp = dev_perp;
+      result.best_epoch = epoch + 1;
+      if (model_prefix.length() > 0) {
+        ofstream model_file(model_prefix + to_string(index) + ".model");
+        Serialize(vocab, sentiment_model, cnn_model, model_file);
+      }
+    }
+    result.cpu_seconds = CpuSeconds() - start_seconds;
+
+    // Give up once we're clearly behind where the best worker was at this point
+    const double best_so_far = PostResult(board, epoch, result.best_dev_perp);
+    if (epoch + 1 >= grace_epochs && result.best_dev_perp > best_so_far * (1.0 + stop_margin)) {
+      result.status = SWEEP_STOPPED_EARLY;
+      break;
+    }
+    if (cpu_budget > 0.0 && result.cpu_seconds >= cpu_budget) {
+      result.status = (epoch + 1 < max_epochs) ? SWEEP_OUT_OF_TIME : SWEEP_FINISHED;
+      break;
+    }
+  }
+  if (result.status == SWEEP_RUNNING) {
+    result.status = SWEEP_FINISHED;
+  }
+  delete sgd;
+}
+
+// Pins the calling process to the slot-th of the CPUs it may run on, so
+// that workers running at once don't share cores
+void PinToCore(unsigned slot) {
+  cpu_set_t allowed;
+  if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+    return;
+  }
+  unsigned index = slot % CPU_COUNT(&allowed);
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+      cpu_set_t mask;
+      CPU_ZERO(&mask);
+      CPU_SET(cpu, &mask);
+      pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+      return;
+    }
+  }
+}
+
+string StatusName(SweepStatus status) {
+  switch (status) {
+    case SWEEP_PENDING: return "not run";
+    case SWEEP_RUNNING: return "running";
+    case SWEEP_FINISHED: return "finished";
+    case SWEEP_STOPPED_EARLY: return "stopped early";
+    case SWEEP_OUT_OF_TIME: return "out of time";
+    case SWEEP_INTERRUPTED: return "interrupted";
+    case SWEEP_FAILED: return "failed";
+  }
+  return "";
+}
+
+void WriteSummary(const vector<SweepConfig>& configs, SweepBoard* board, ostream& out) {
+  vector<unsigned> order(configs.size());
+  iota(order.begin(), order.end(), 0);
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return board->results()[a].best_dev_perp < board->results()[b].best_dev_perp;
+  });
+
+  out << "rank\tconfig\toptimizer\tlearning_rate\tword_dim\tnode_dim\thidden_dim\tbatch_size\tdev_perp\tbest_epoch\tepochs\tcpu_seconds\tstatus" << endl;
+  for (unsigned rank = 0; rank < order.size(); ++rank) {
+    const SweepConfig& config = configs[order[rank]];
+    const SweepResult& result = board->results()[order[rank]];
+    out << rank + 1 << "\t" << order[rank] << "\t" << config.optimizer << "\t" << config.learning_rate << "\t";
+    out << config.word_dim << "\t" << config.node_dim << "\t" << config.hidden_dim << "\t" << config.batch_size << "\t";
+    out << fixed << setprecision(4) << result.best_dev_perp << "\t" << result.best_epoch << "\t" << result.epochs << "\t";
+    out << setprecision(1) << result.cpu_seconds << "\t" << StatusName(result.status) << endl;
+    out.unsetf(ios::floatfield);
+  }
+}
+
+int main(int argc, char** argv) {
+  signal (SIGINT, ctrlc_handler);
+
+  po::options_description desc("description");
+  desc.add_options()
+  ("training_set", po::value<string>()->required(), "Training trees")
+  ("dev_set", po::value<string>()->required(), "Dev trees, used to compare configurations")
+  ("num_iterations,i", po::value<unsigned>()->default_value(10), "Maximum number of epochs for each configuration")
+  ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed, shared by every configuration. If this value is 0 a seed will be chosen randomly.")
+  ("threads,j", po::value<unsigned>()->default_value(thread::hardware_concurrency()), "Number of threads to use when reading the treebanks")
+  ("jobs", po::value<unsigned>()->default_value(thread::hardware_concurrency()), "Number of configurations to train at once, each pinned to its own core where there are enough")
+  ("worker_cpu_seconds", po::value<double>()->default_value(0.0), "CPU time budget for each configuration, checked after every epoch (0 for no limit)")
+  ("grace_epochs", po::value<unsigned>()->default_value(2), "Epochs every configuration gets before it can be stopped early")
+  ("stop_margin", po::value<double>()->default_value(0.05), "Stop a configuration once its dev perplexity is this fraction worse than the best any configuration had after as many epochs")
+  ("optimizers", po::value<string>()->default_value("sgd,adam"), "Comma-separated optimizers: sgd, momentum:<value>, adagrad, adadelta, rmsprop, or adam")
+  ("learning_rates", po::value<string>()->default_value("0.1"), "Comma-separated learning rates (used as alpha for Adam)")
+  ("word_dims", po::value<string>()->default_value("50"), "Comma-separated word embedding dimensions")
+  ("node_dims", po::value<string>()->default_value("50"), "Comma-separated TreeLSTM state dimensions")
+  ("hidden_dims", po::value<string>()->default_value("50"), "Comma-separated final MLP hidden dimensions")
+  ("batch_sizes", po::value<string>()->default_value("1"), "Comma-separated minibatch sizes")
+  ("layers", po::value<unsigned>()->default_value(1), "Number of TreeLSTM layers, shared by every configuration")
+  ("branching", po::value<unsigned>()->default_value(5), "Maximum number of children per tree node, shared by every configuration")
+  ("leaf_encoder", po::value<string>()->default_value("lookup"), "How leaves are encoded, shared by every configuration: lookup or bilstm (see train)")
+  ("regularization", po::value<double>()->default_value(0.0), "L2 Regularization strength")
+  ("eta_decay", po::value<double>()->default_value(0.05), "Learning rate decay rate (SGD only)")
+  ("no_clipping", "Disable clipping of gradients")
+  ("lazy_updates", "Only update the lookup parameter rows that have gradients (see train --lazy_updates)")
+  ("model_prefix", po::value<string>(), "Save each configuration's best model to this prefix followed by its config number and .model")
+  ("summary", po::value<string>(), "Write the summary table to this file as well as stdout")
+  ("help", "Display this help message");
+
+  po::positional_options_description positional_options;
+  positional_options.add("training_set", 1);
+  positional_options.add("dev_set", 1);
+
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional_options).run(), vm);
+
+  if (vm.count("help")) {
+    cerr << desc;
+    return 1;
+  }
+
+  po::notify(vm);
+
+  vector<SweepConfig> configs;
+  for (const string& optimizer : ParseList<string>("optimizers", vm["optimizers"].as<string>())) {
+    for (double learning_rate : ParseList<double>("learning_rates", vm["learning_rates"].as<string>())) {
+      for (unsigned word_dim : ParseList<unsigned>("word_dims", vm["word_dims"].as<string>())) {
+        for (unsigned node_dim : ParseList<unsigned>("node_dims", vm["node_dims"].as<string>())) {
+          for (unsigned hidden_dim : ParseList<unsigned>("hidden_dims", vm["hidden_dims"].as<string>())) {
+            for (unsigned batch_size : ParseList<unsigned>("batch_sizes", vm["batch_sizes"].as<string>())) {
+              configs.push_back({optimizer, learning_rate, word_dim, node_dim, hidden_dim, batch_size});
+            }
+          }
+        }
+      }
+    }
+  }
+  // Catch bad grids before any worker has started
+  ParseLeafEncoder(vm["leaf_encoder"].as<string>());
+  for (const SweepConfig& config : configs) {
+    OptimizerArguments(config, vm);
+    if (config.node_dim % 2 != 0 || config.batch_size == 0) {
+      cerr << "ERROR: Invalid configuration " << Describe(config) << ". Node dimensions must be even and batch sizes positive." << endl;
+      return 1;
+    }
+  }
+
+  const unsigned num_iterations = vm["num_iterations"].as<unsigned>();
+  const unsigned jobs = max(vm["jobs"].as<unsigned>(), 1U);
+  cnn::Initialize(argc, argv, vm["random_seed"].as<unsigned>());
+
+  // Everything loaded here is shared copy-on-write with every worker
+  Vocabulary vocab;
+  vocab.Convert("UNK");
+  vector<SyntaxTree>* training_set = ReadTrees(vm["training_set"].as<string>(), &vocab, vm["threads"].as<unsigned>());
+  if (training_set == nullptr) {
+    return 1;
+  }
+  vector<SyntaxTree>* dev_set = ReadTrees(vm["dev_set"].as<string>(), &vocab, vm["threads"].as<unsigned>());
+  if (dev_set == nullptr) {
+    return 1;
+  }
+  vocab.Freeze();
+
+  SweepBoard* board = CreateBoard(num_iterations, configs.size());
+  cerr << "Sweeping " << configs.size() << " configurations, " << jobs << " at a time" << endl;
+
+  map<pid_t, unsigned> running;
+  map<pid_t, unsigned> running_slots; // The core slot each worker is pinned to
+  vector<bool> slot_busy(jobs, false);
+  unsigned next = 0;
+  while ((next < configs.size() && !ctrlc_pressed) || running.size() > 0) {
+    if (next < configs.size() && running.size() < jobs && !ctrlc_pressed) {
+      const unsigned slot = find(slot_busy.begin(), slot_busy.end(), false) - slot_busy.begin();
+      cout.flush();
+      cerr.flush();
+      pid_t pid = fork();
+      if (pid < 0) {
+        cerr << "ERROR: Unable to start a worker" << endl;
+        ctrlc_pressed = true;
+        continue;
+      }
+      else if (pid == 0) {
+        // Ctrl-c reaches every worker too, and each stops at its next tree
+        PinToCore(slot);
+        RunWorker(next, configs[next], *training_set, *dev_set, vocab, board, vm);
+        _exit(0);
+      }
+      cerr << "Started config " << next << ": " << Describe(configs[next]) << endl;
+      running[pid] = next++;
+      running_slots[pid] = slot;
+      slot_busy[slot] = true;
+      continue;
+    }
+
+    int wait_status;
+    pid_t pid = wait(&wait_status);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    auto it = running.find(pid);
+    if (it == running.end()) {
+      continue;
+    }
+    SweepResult& result = board->results()[it->second];
+    if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
+      result.status = SWEEP_FAILED;
+    }
+    cerr << "Config " << it->second << " " << StatusName(result.status) << " after " << result.epochs << " epochs, dev perp: " << result.best_dev_perp << endl;
+    running.erase(it);
+    slot_busy[running_slots[pid]] = false;
+    running_slots.erase(pid);
+  }
+
+  WriteSummary(configs, board, cout);
+  if (vm.count("summary")) {
+    ofstream summary_file(vm["summary"].as<string>());
+    WriteSummary(configs, board, summary_file);
+  }
+  return 0;
+}
@@ -5,7 +5,7 @@
 
 SyntaxTree::SyntaxTree() : dict(nullptr), label_(-1), id_(-1) {}
 
-SyntaxTree::SyntaxTree(string tree, Dict* dict) : dict(dict), id_(-1) {
+SyntaxTree::SyntaxTree(string tree, Vocabulary* dict) : dict(dict), label_(-1), id_(-1) {
   // Sometimes Berkeley parser fails to parse a sentence and just outputs ()
   if (tree == "()") {
     return;
@@ -67,6 +67,14 @@ SyntaxTree::SyntaxTree(string tree, Dict* dict) : dict(dict), id_(-1) {
   }
 }
 
+SyntaxTree::SyntaxTree(WordId word, Vocabulary* dict) : dict(dict), label_(word), id_(-1) {}
+
+SyntaxTree::SyntaxTree(unsigned sentiment, vector<SyntaxTree> children, Vocabulary* dict) : dict(dict), id_(-1), sentiment_(sentiment), children(move(children)) {
+  // Labels are interned as words when trees are read, so dict may be frozen by now
+  const string label_string = to_string(sentiment);
+  label_ = dict->Lookup(label_string.c_str(), label_string.length());
+}
+
 bool SyntaxTree::IsTerminal() const {
   return children.size() == 0;
 }
@@ -184,6 +192,17 @@ unsigned SyntaxTree::AssignNodeIds(unsigned start) {
   return start + 1;
 }
 
+void SyntaxTree::RemapLabels(const vector<WordId>& mapping, Vocabulary* new_dict) {
+  dict = new_dict;
+  if (label_ >= 0) {
+    assert ((unsigned)label_ < mapping.size());
+    label_ = mapping[label_];
+  }
+  for (SyntaxTree& child : children) {
+    child.RemapLabels(mapping, new_dict);
+  }
+}
+
 ostream& operator<< (ostream& stream, const SyntaxTree& tree) {
   return stream << tree.ToString();
 }
@@ -1,18 +1,19 @@
 #pragma once
 #include <vector>
 #include <string>
-#include "cnn/dict.h"
+#include "vocabulary.h"
 //#include "utils.h"
 
 using namespace std;
-using namespace cnn;
-
-typedef int WordId;
 
 class SyntaxTree {
 public:
   SyntaxTree();
-  SyntaxTree(string tree, Dict* dict);
+  SyntaxTree(string tree, Vocabulary* dict);
+  // A terminal holding word, whose id is already in dict
+  SyntaxTree(WordId word, Vocabulary* dict);
+  // An internal node over children, labeled with sentiment
+  SyntaxTree(unsigned sentiment, vector<SyntaxTree> children, Vocabulary* dict);
 
   bool IsTerminal() const;
   unsigned NumChildren() const;
@@ -30,8 +31,10 @@ public:
 
   string ToString() const;
   unsigned AssignNodeIds(unsigned start = 0);
+  // Moves the tree to a different dictionary, where mapping[old_id] is new_id
+  void RemapLabels(const vector<WordId>& mapping, Vocabulary* new_dict);
 private:
-  Dict* dict;
+  Vocabulary* dict;
   WordId label_;
   unsigned id_;
   unsigned sentiment_;
@@ -7,34 +7,28 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <csignal>
 #include <random>
 #include <memory>
 #include <algorithm>
+#include <numeric>
+#include <thread>
+#include <chrono>
 
 #include "sentiment.h"
+#include "memory.h"
+#include "corpus.h"
 #include "train.h"
+#include "model_io.h"
+#include "training_loop.h"
+#include "pipeline.h"
+#include "embeddings.h"
 
 using namespace cnn;
 using namespace std;
 namespace po = boost::program_options;
 
-pair<cnn::real, unsigned> ComputeLoss(const vector<SyntaxTree>& data, SentimentModel& model) {
-  cnn::real loss = 0.0;
-  unsigned node_count = 0;
-  for (unsigned i = 0; i < data.size(); ++i) {
-    ComputationGraph cg;
-    model.BuildGraph(data[i], cg);
-    node_count += data[i].NumNodes();
-    double l = as_scalar(cg.forward());
-    loss += l;
-    if (ctrlc_pressed) {
-      break;
-    }
-  }
-  return make_pair(loss, node_count);
-}
-
 int main(int argc, char** argv) {
   signal (SIGINT, ctrlc_handler);
 
@@ -45,24 +39,35 @@ int main(int argc, char** argv) {
   ("num_iterations,i", po::value<unsigned>()->default_value(UINT_MAX), "Number of epochs to train for")
   ("batch_size,b", po::value<unsigned>()->default_value(1), "Size of minibatches")
   ("random_seed,r", po::value<unsigned>()->default_value(0), "Random seed. If this value is 0 a seed will be chosen randomly.")
-  // Optimizer configuration
-  ("sgd", "Use SGD for optimization")
-  ("momentum", po::value<double>(), "Use SGD with this momentum value")
-  ("adagrad", "Use Adagrad for optimization")
-  ("adadelta", "Use Adadelta for optimization")
-  ("rmsprop", "Use RMSProp for optimization")
-  ("adam", "Use Adam for optimization")
-  ("learning_rate", po::value<double>(), "Learning rate for optimizer (SGD, Adagrad, Adadelta, and RMSProp only)")
-  ("alpha", po::value<double>(), "Alpha (Adam only)")
-  ("beta1", po::value<double>(), "Beta1 (Adam only)")
-  ("beta2", po::value<double>(), "Beta2 (Adam only)")
-  ("rho", po::value<double>(), "Moving average decay parameter (RMSProp and Adadelta only)")
-  ("epsilon", po::value<double>(), "Epsilon value for optimizer (Adagrad, Adadelta, RMSProp, and Adam only)")
-  ("regularization", po::value<double>()->default_value(0.0), "L2 Regularization strength")
-  ("eta_decay", po::value<double>()->default_value(0.05), "Learning rate decay rate (SGD only)")
-  ("no_clipping", "Disable clipping of gradients")
-  // End optimizer configuration
+  ("threads,j", po::value<unsigned>()->default_value(thread::hardware_concurrency()), "Number of threads to use when reading the treebanks")
+  ("max_nodes", po::value<unsigned>()->default_value(0), "Maximum number of nodes in one tree's graph (0 for no limit)")
+  ("max_graph_memory", po::value<double>()->default_value(0.0), "Maximum estimated graph memory for one tree, in MB (0 for no limit)")
+  ("stream", "Stream the training set from disk instead of loading it into memory. The training set may then be a comma-separated list of shard files.")
+  ("shuffle_buffer", po::value<unsigned>()->default_value(100000), "Number of trees to shuffle among when streaming")
+  ("pipeline", "Prepare trees on a background thread, and apply each update while the next tree's graph is being built")
+  ("pipeline_depth", po::value<unsigned>()->default_value(64), "Number of trees to prepare ahead with --pipeline")
+  ("dev_confidence", po::value<double>()->default_value(3.0), "Stop scoring the dev set early once its loss is this many standard errors worse than the best so far (0 to always score all of it)")
+  ("dev_chunk", po::value<unsigned>()->default_value(100), "Number of dev trees to score between early stopping checks")
+  ("dedup", "Train on each distinct tree once per epoch, with its loss weighted by its number of copies in the training set")
+  ("sample_fraction", po::value<double>()->default_value(1.0), "After the first epoch, train on this fraction of the training set per epoch, drawing trees in proportion to their recent loss and weighting each by its importance weight, so that gradients stay unbiased (1 for plain shuffled epochs)")
+  ("sample_decay", po::value<double>()->default_value(0.5), "With --sample_fraction, how much of a tree's average loss to keep each time it's trained on")
+  ("sample_uniform", po::value<double>()->default_value(0.1), "With --sample_fraction, the fraction of the sampling probability spread evenly over all trees. Importance weights are at most 1 / this.")
+  ("batch_graph", "Build a single graph for each minibatch, computing the final MLP and loss for all of its trees at once")
+  ("oversize_policy", po::value<string>()->default_value("skip"), "What to do with trees over the limits: skip, split (into constituents that fit, so the root and other nodes above them are not trained on), stream (chunk by chunk, truncating gradients between chunks), or checkpoint (chunk by chunk with exact gradients, recomputing each chunk once). Only skip works with --leaf_encoder bilstm.")
+  // Model configuration
+  ("word_dim", po::value<unsigned>()->default_value(50), "Dimension of word embeddings")
+  ("pretrained_embeddings", po::value<string>(), "Initialize the embeddings of the words it covers from this file, written by convert_embeddings. Its dimension must match word_dim.")
+  ("node_dim", po::value<unsigned>()->default_value(50), "Dimension of TreeLSTM node states")
+  ("hidden_dim", po::value<unsigned>()->default_value(50), "Dimension of the final MLP's hidden layer")
+  ("layers", po::value<unsigned>()->default_value(1), "Number of TreeLSTM layers")
+  ("branching", po::value<unsigned>()->default_value(5), "Maximum number of children per tree node")
+  ("leaf_encoder", po::value<string>()->default_value("lookup"), "How leaves are encoded: lookup (each word's embedding) or bilstm (a bidirectional LSTM over the sentence, with node_dim / 2 units each way)")
+  // Distillation
+  ("teacher", po::value<string>(), "Train to match this model's predictions (knowledge distillation). The teacher's vocabulary is used, and oversize trees are skipped.")
+  ("distill_weight", po::value<double>()->default_value(0.9), "Weight of the teacher's soft targets in the loss, with the rest going to the gold labels")
+  ("temperature", po::value<double>()->default_value(2.0), "Softmax temperature used for the teacher's and the student's distributions")
   ("help", "Display this help message");
+  desc.add(OptimizerOptions());
 
   po::positional_options_description positional_options;
   positional_options.add("training_set", 1);
@@ -83,77 +88,318 @@ int main(int argc, char** argv) {
   const unsigned num_iterations = vm["num_iterations"].as<unsigned>();
   const unsigned random_seed = vm["random_seed"].as<unsigned>();
   const unsigned minibatch_size = vm["batch_size"].as<unsigned>();
+  const bool batch_graph = vm.count("batch_graph") > 0;
+  const unsigned num_threads = vm["threads"].as<unsigned>();
+  const bool distill = vm.count("teacher") > 0;
+  const bool streaming = vm.count("stream") > 0;
+  const unsigned shuffle_buffer = vm["shuffle_buffer"].as<unsigned>();
+  const bool pipelined = vm.count("pipeline") > 0;
+  const bool dedup = vm.count("dedup") > 0;
+  const double dev_confidence = vm["dev_confidence"].as<double>();
+  const unsigned dev_chunk = vm["dev_chunk"].as<unsigned>();
+  const unsigned pipeline_depth = vm["pipeline_depth"].as<unsigned>();
+  const double sample_fraction = vm["sample_fraction"].as<double>();
+  const double sample_uniform = vm["sample_uniform"].as<double>();
+  const bool sampling = sample_fraction < 1.0;
+  if (sample_fraction <= 0.0 || sample_fraction > 1.0 || sample_uniform <= 0.0 || sample_uniform > 1.0) {
+    cerr << "Invalid parameters: sample_fraction and sample_uniform must be more than 0 and at most 1." << endl;
+    return 1;
+  }
+  if (sampling && (streaming || batch_graph)) {
+    cerr << "Invalid parameters: sampling needs each tree's own loss, so it can't be combined with --stream or --batch_graph." << endl;
+    return 1;
+  }
+  if (distill && streaming) {
+    cerr << "Invalid parameters: distillation needs the whole training set in memory, so it can't be combined with --stream." << endl;
+    return 1;
+  }
+  if (distill && (batch_graph || vm["oversize_policy"].as<string>() != "skip")) {
+    cerr << "Invalid parameters: distillation trains on one whole tree at a time, skipping oversize trees, so it can't be combined with --batch_graph or an --oversize_policy other than skip." << endl;
+    return 1;
+  }
+  if (dedup && streaming) {
+    cerr << "Invalid parameters: deduplication needs the whole training set in memory, so it can't be combined with --stream." << endl;
+    return 1;
+  }
+  const cnn::real distill_weight = vm["distill_weight"].as<double>();
+  const cnn::real temperature = vm["temperature"].as<double>();
+  if (distill && (distill_weight < 0.0 || distill_weight > 1.0 || temperature <= 0.0)) {
+    cerr << "Invalid parameters: distill_weight must be between 0 and 1, and temperature must be positive." << endl;
+    return 1;
+  }
+  TreeLimits limits;
+  limits.max_nodes = vm["max_nodes"].as<unsigned>();
+  limits.max_graph_bytes = (size_t)(vm["max_graph_memory"].as<double>() * 1024 * 1024);
+  limits.policy = ParseOversizePolicy(vm["oversize_policy"].as<string>());
 
   cnn::Initialize(argc, argv, random_seed);
   std::mt19937 rndeng(42);
-  SentimentModel* sentiment_model = new SentimentModel();
+  SentimentModel* sentiment_model = new SentimentModel(vm["word_dim"].as<unsigned>(), vm["node_dim"].as<unsigned>(), vm["hidden_dim"].as<unsigned>(), vm["layers"].as<unsigned>(), vm["branching"].as<unsigned>(), ParseLeafEncoder(vm["leaf_encoder"].as<string>()));
+  if (!SupportsOversizePolicy(limits, *sentiment_model)) {
+    cerr << "Invalid parameters: the bilstm leaf encoder reads whole sentences, so the only oversize_policy it supports is skip." << endl;
+    return 1;
+  }
   Model* cnn_model = new Model();
-  Dict vocab;
 
-  vocab.Convert("UNK");
-  vector<SyntaxTree>* training_set = ReadTrees(train_filename, &vocab);
-  if (training_set == nullptr) {
-    return 1;
+  // A student has to share its teacher's word ids
+  Vocabulary* vocab = nullptr;
+  Model* teacher_cnn_model = nullptr;
+  SentimentModel* teacher = nullptr;
+  if (distill) {
+    tie(vocab, teacher_cnn_model, teacher) = LoadModel(vm["teacher"].as<string>());
+  }
+  else {
+    vocab = new Vocabulary();
+    vocab->Convert("UNK");
   }
-  assert (minibatch_size <= training_set->size());
-  //vocab.Freeze();
-  vector<SyntaxTree>* dev_set = ReadTrees(dev_filename, &vocab);
 
-  sentiment_model->InitializeParameters(*cnn_model, vocab.size());
+  // When streaming, only the vocabulary is built up front
+  vector<SyntaxTree>* training_set = nullptr;
+  vector<string> training_shards;
+  unsigned training_size = 0;
+  if (streaming) {
+    stringstream ss(train_filename);
+    for (string shard; getline(ss, shard, ',');) {
+      training_shards.push_back(shard);
+    }
+    if (!ScanVocabulary(training_shards, vocab, num_threads, &training_size)) {
+      return 1;
+    }
+  }
+  else {
+    training_set = ReadTrees(train_filename, vocab, num_threads);
+    if (training_set == nullptr) {
+      return 1;
+    }
+    training_size = training_set->size();
+  }
+  // How many copies of each training tree there were
+  vector<unsigned> copies;
+  if (dedup) {
+    copies = DeduplicateTrees(training_set);
+    cerr << "Collapsed " << training_size << " training trees into " << training_set->size() << " distinct ones" << endl;
+    training_size = training_set->size();
+  }
+  assert (minibatch_size <= training_size);
+  //vocab->Freeze();
+  vector<SyntaxTree>* dev_set = ReadTrees(dev_filename, vocab, num_threads);
+  if (streaming) {
+    // The stream's reader thread needs a read-only vocabulary
+    vocab->SetUnk("UNK");
+    vocab->Freeze();
+  }
+
+  sentiment_model->InitializeParameters(*cnn_model, vocab->size());
+  if (vm.count("pretrained_embeddings")) {
+    const string embeddings_filename = vm["pretrained_embeddings"].as<string>();
+    PretrainedEmbeddings pretrained;
+    if (!pretrained.Map(embeddings_filename)) {
+      cerr << "ERROR: Unable to map " << embeddings_filename << ". Was it written by convert_embeddings?" << endl;
+      return 1;
+    }
+    if (pretrained.dim() != sentiment_model->WordEmbeddingDim()) {
+      cerr << "ERROR: " << embeddings_filename << " has " << pretrained.dim() << " dimensions, but word_dim is " << sentiment_model->WordEmbeddingDim() << endl;
+      return 1;
+    }
+    const unsigned found_count = sentiment_model->InitializeEmbeddings(pretrained, *vocab);
+    cerr << "Initialized " << found_count << " of " << vocab->size() << " word embeddings from " << embeddings_filename << endl;
+  }
   Trainer* sgd = CreateTrainer(*cnn_model, vm);
+  const unsigned max_nodes = MaxTreeNodes(limits, *sentiment_model);
+  GraphMemoryMonitor memory_monitor;
+
+  vector<vector<cnn::real>> soft_targets;
+  if (distill) {
+    cerr << "Computing the teacher's soft targets...\n";
+    soft_targets = ComputeSoftTargets(*training_set, *teacher, MaxTreeNodes(limits, *teacher), temperature, &ctrlc_pressed);
+    delete teacher;
+    delete teacher_cnn_model;
+  }
+  cerr << "Parameter memory: " << FormatBytes(ParameterBytes(*cnn_model)) << ", optimizer memory: " << FormatBytes(OptimizerBytes(*cnn_model, sgd)) << endl;
 
   cerr << "Training model...\n";
   unsigned minibatch_count = 0;
+  vector<const SyntaxTree*> minibatch;
+  vector<cnn::real> minibatch_weights;
   const unsigned report_frequency = 500;
   cnn::real best_dev_loss = numeric_limits<cnn::real>::max();
+  // Shuffle indices rather than trees, keeping any soft targets aligned
+  vector<unsigned> order(streaming ? 0 : training_size);
+  iota(order.begin(), order.end(), 0);
+  // With sampling, the first epoch is a full pass that gives every tree a loss
+  unique_ptr<LossSampler> sampler;
+  vector<double> importance_weights;
+  if (sampling) {
+    sampler.reset(new LossSampler(training_size, vm["sample_decay"].as<double>(), sample_uniform));
+  }
+  AsyncUpdate async_update;
+  double training_seconds = 0.0;
   for (unsigned iteration = 0; iteration < num_iterations; iteration++) {
+    const auto epoch_start = chrono::steady_clock::now();
     unsigned word_count = 0;
     unsigned tword_count = 0;
-    random_shuffle(training_set->begin(), training_set->end());
+    unsigned oversize_count = 0;
+    unsigned epoch_size = training_size;
+    unique_ptr<TreeStream> stream;
+    if (streaming) {
+      stream.reset(new TreeStream(training_shards, vocab, shuffle_buffer, rndeng()));
+    }
+    else if (sampling && iteration > 0) {
+      epoch_size = max((unsigned)round(sample_fraction * training_size), max(minibatch_size, 1U));
+      order = sampler->Sample(epoch_size, rndeng, &importance_weights);
+    }
+    else {
+      random_shuffle(order.begin(), order.end());
+    }
+
+    // Yields this epoch's trees in training order
+    unsigned next_index = 0;
+    TreePipeline::Source source = [&]() -> unique_ptr<PreparedTree> {
+      unique_ptr<PreparedTree> prepared(new PreparedTree());
+      if (streaming) {
+        prepared->owned = stream->Next();
+        if (prepared->owned == nullptr) {
+          return nullptr;
+        }
+        prepared->index = next_index++;
+        prepared->tree = prepared->owned.get();
+      }
+      else {
+        if (next_index >= epoch_size) {
+          return nullptr;
+        }
+        prepared->index = order[next_index++];
+        prepared->tree = &training_set->at(prepared->index);
+      }
+      return prepared;
+    };
+    unique_ptr<TreePipeline> pipeline;
+    if (pipelined) {
+      pipeline.reset(new TreePipeline(source, pipeline_depth));
+    }
+
+    // Trees must outlive the minibatch they're in
+    vector<unique_ptr<PreparedTree>> held_trees;
+    memory_monitor.ResetPeak();
     double loss = 0.0;
     double tloss = 0.0;
-    for (unsigned i = 0; i < training_set->size(); ++i) {
-      // These braces cause cg to go out of scope before we ever try to call
-      // ComputeLoss() on the dev set. Without them, ComputeLoss() tries to
-      // create a second ComputationGraph, which makes CNN quite unhappy.
+    for (unsigned i = 0; i < epoch_size; ++i) {
+      // ProcessTree() lets its ComputationGraph go out of scope before we
+      // ever try to call ComputeLoss() on the dev set. Otherwise
+      // ComputeLoss() would create a second ComputationGraph, which makes
+      // CNN quite unhappy.
       {
-        ComputationGraph cg;
-        SyntaxTree& example = training_set->at(i);
-        sentiment_model->BuildGraph(example, cg);
-        unsigned sent_word_count = example.NumNodes();
+        unique_ptr<PreparedTree> prepared = pipelined ? pipeline->Next() : source();
+        if (prepared == nullptr) {
+          break;
+        }
+        const SyntaxTree& example = *prepared->tree;
+        const cnn::real importance_weight = importance_weights.size() > 0 ? importance_weights[prepared->index] : 1.0;
+        const cnn::real weight = (dedup ? copies[prepared->index] : 1) * importance_weight;
+        unsigned sent_word_count = 0;
+        double sent_loss = 0.0;
+        if (distill) {
+          async_update.Wait();
+          CatchUpRows(sgd, *sentiment_model, {&example});
+          sent_loss = ProcessDistillation(example, soft_targets[prepared->index], *sentiment_model, temperature, distill_weight, max_nodes, memory_monitor, &sent_word_count, &oversize_count, weight);
+        }
+        else if (batch_graph && example.NumNodes() <= max_nodes) {
+          minibatch.push_back(&example);
+          minibatch_weights.push_back(weight);
+          sent_word_count = example.NumNodes();
+        }
+        else if (pipelined && prepared->plan.node_count <= max_nodes) {
+          sent_loss = ProcessPreparedTree(*prepared, *sentiment_model, memory_monitor, sgd, &async_update, weight);
+          sent_word_count = prepared->plan.node_count;
+        }
+        else {
+          async_update.Wait();
+          CatchUpRows(sgd, *sentiment_model, {&example});
+          sent_loss = ProcessTree(example, *sentiment_model, limits, max_nodes, true, memory_monitor, &sent_word_count, &oversize_count, weight);
+        }
+        // Report per-node losses over the original corpus, as if the tree
+        // had been drawn uniformly
+        sent_loss /= importance_weight;
+        sent_word_count *= dedup ? copies[prepared->index] : 1;
+        if (sampler != nullptr) {
+          sampler->Observe(prepared->index, sent_loss);
+        }
+        held_trees.push_back(move(prepared));
+        // Minibatches can't span epochs, since shuffling moves the trees
+        if (minibatch.size() > 0 && (minibatch_count + 1 == minibatch_size || i + 1 == epoch_size)) {
+          async_update.Wait();
+          CatchUpRows(sgd, *sentiment_model, minibatch);
+          sent_loss += ProcessBatch(minibatch, *sentiment_model, memory_monitor, &minibatch_weights);
+          minibatch.clear();
+          minibatch_weights.clear();
+        }
+        if (minibatch.size() == 0) {
+          held_trees.clear();
+        }
         word_count += sent_word_count;
         tword_count += sent_word_count;
-        double sent_loss = as_scalar(cg.forward());
         loss += sent_loss;
         tloss += sent_loss;
-        cg.backward();
       }
       if (i % report_frequency == report_frequency - 1) {
-        float fractional_iteration = (float)iteration + ((float)(i + 1) / training_set->size());
+        float fractional_iteration = (float)iteration + ((float)(i + 1) / epoch_size);
         cerr << "--" << fractional_iteration << "     perp=" << exp(tloss/tword_count) << endl;
         cerr.flush();
         tloss = 0;
         tword_count = 0;
       }
       if (++minibatch_count == minibatch_size) {
-        sgd->update(1.0 / minibatch_size);
+        if (pipelined) {
+          async_update.Start(sgd, 1.0 / minibatch_size);
+        }
+        else {
+          sgd->update(1.0 / minibatch_size);
+        }
         minibatch_count = 0;
       }
       if (ctrlc_pressed) {
         break;
       }
     }
+    async_update.Wait();
+    // The stream may end early, or ctrl-c may have been pressed mid-batch
+    if (minibatch.size() > 0) {
+      CatchUpRows(sgd, *sentiment_model, minibatch);
+      loss += ProcessBatch(minibatch, *sentiment_model, memory_monitor, &minibatch_weights);
+      minibatch.clear();
+      minibatch_weights.clear();
+    }
+    held_trees.clear();
+    pipeline.reset();
+    FlushTrainer(sgd);
+    if (stream != nullptr && stream->failed()) {
+      return 1;
+    }
+    stream.reset();
     //sgd->update_epoch();
+    const double epoch_seconds = chrono::duration<double>(chrono::steady_clock::now() - epoch_start).count();
+    training_seconds += epoch_seconds;
     cerr << "##" << (float)(iteration + 1) << "     perp=" << exp(loss / word_count) << endl;
+    cerr << "  trained on " << epoch_size << " trees in " << epoch_seconds << "s, " << training_seconds << "s in total" << endl;
+    cerr << "  peak tree graph memory: " << FormatBytes(memory_monitor.peak_bytes()) << ", high water: " << FormatBytes(memory_monitor.high_water_bytes()) << " of " << FormatBytes(memory_monitor.capacity_bytes());
+    if (oversize_count > 0) {
+      cerr << ", oversize trees: " << oversize_count;
+    }
+    cerr << endl;
     if (!ctrlc_pressed) {
-      auto dev_loss = ComputeLoss(*dev_set, *sentiment_model);
-      cnn::real dev_perp = exp(dev_loss.first / dev_loss.second);
-      bool new_best = dev_loss.first <= best_dev_loss;
-      cerr << "**" << iteration + 1 << " dev perp: " << dev_perp << (new_best ? " (New best!)" : "") << endl;
+      LossEstimate dev_loss = ProgressiveLoss(*dev_set, *sentiment_model, limits, max_nodes, memory_monitor, best_dev_loss, dev_confidence, dev_chunk, rndeng, &ctrlc_pressed);
+      cnn::real dev_perp = exp(dev_loss.loss / dev_loss.node_count);
+      bool new_best = dev_loss.complete && dev_loss.loss <= best_dev_loss;
+      if (dev_loss.complete) {
+        cerr << "**" << iteration + 1 << " dev perp: " << dev_perp << " after " << training_seconds << "s of training" << (new_best ? " (New best!)" : "") << endl;
+      }
+      else {
+        cerr << "**" << iteration + 1 << " dev perp: ~" << dev_perp << " (stopped after " << dev_loss.tree_count << " of " << dev_set->size() << " trees)" << endl;
+      }
       cerr.flush();
       if (new_best) {
-        Serialize(vocab, *sentiment_model, *cnn_model);
-        best_dev_loss = dev_loss.first;
+        Serialize(*vocab, *sentiment_model, *cnn_model);
+        best_dev_loss = dev_loss.loss;
       }
     }
 
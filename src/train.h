@@ -1,5 +1,6 @@
 #include "cnn/mp.h"
 #include "syntax_tree.h"
+#include "lazy_trainer.h"
 using namespace cnn;
 using namespace std;
 namespace po = boost::program_options;
@@ -21,39 +22,51 @@ void ctrlc_handler(int signal) {
   }
 }
 
-void Serialize(Dict& dict, SentimentModel& sentiment_model, Model& cnn_model) {
-  int r = ftruncate(fileno(stdout), 0);
-  if (r != 0) {
-    //cerr << "WARNING: Unable to truncate stdout. Error " << errno << endl;
-  }
-  fseek(stdout, 0, SEEK_SET);
-
-  boost::archive::text_oarchive oa(cout);
+void Serialize(Vocabulary& dict, SentimentModel& sentiment_model, Model& cnn_model, ostream& out) {
+  boost::archive::text_oarchive oa(out);
   oa & dict;
   oa & sentiment_model;
   oa & cnn_model;
 }
 
-vector<SyntaxTree>* ReadTrees(const string& filename, Dict* dict) {
-  ifstream f(filename);
-  if (!f.is_open()) {
-    return nullptr;
-  }
-
-  vector<SyntaxTree>* data = new vector<SyntaxTree>();
-  for (string line; getline(f, line);) {
-    SyntaxTree tree(line, dict);
-    tree.AssignNodeIds();
-    data->push_back(tree);
+// Overwrites stdout with the model
+void Serialize(Vocabulary& dict, SentimentModel& sentiment_model, Model& cnn_model) {
+  int r = ftruncate(fileno(stdout), 0);
+  if (r != 0) {
+    //cerr << "WARNING: Unable to truncate stdout. Error " << errno << endl;
   }
+  fseek(stdout, 0, SEEK_SET);
+  Serialize(dict, sentiment_model, cnn_model, cout);
+}
 
-  return data;
+// Options read by CreateTrainer()
+po::options_description OptimizerOptions() {
+  po::options_description desc("optimizer");
+  desc.add_options()
+  ("sgd", "Use SGD for optimization")
+  ("momentum", po::value<double>(), "Use SGD with this momentum value")
+  ("adagrad", "Use Adagrad for optimization")
+  ("adadelta", "Use Adadelta for optimization")
+  ("rmsprop", "Use RMSProp for optimization")
+  ("adam", "Use Adam for optimization")
+  ("learning_rate", po::value<double>(), "Learning rate for optimizer (SGD, Adagrad, Adadelta, and RMSProp only)")
+  ("alpha", po::value<double>(), "Alpha (Adam only)")
+  ("beta1", po::value<double>(), "Beta1 (Adam only)")
+  ("beta2", po::value<double>(), "Beta2 (Adam only)")
+  ("rho", po::value<double>(), "Moving average decay parameter (RMSProp and Adadelta only)")
+  ("epsilon", po::value<double>(), "Epsilon value for optimizer (Adagrad, Adadelta, RMSProp, and Adam only)")
+  ("regularization", po::value<double>()->default_value(0.0), "L2 Regularization strength")
+  ("eta_decay", po::value<double>()->default_value(0.05), "Learning rate decay rate (SGD only)")
+  ("no_clipping", "Disable clipping of gradients")
+  ("lazy_updates", "Only update the rows of lookup parameters (e.g. word embeddings) that have gradients, catching other rows up in closed form when they next get one. L2 regularization becomes decoupled weight decay.");
+  return desc;
 }
 
 Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   double regularization_strength = vm["regularization"].as<double>();
   double eta_decay = vm["eta_decay"].as<double>();
   bool clipping_enabled = (vm.count("no_clipping") == 0);
+  bool lazy = (vm.count("lazy_updates") > 0);
   unsigned learner_count = vm.count("sgd") + vm.count("momentum") + vm.count("adagrad") + vm.count("adadelta") + vm.count("rmsprop") + vm.count("adam");
   if (learner_count > 1) {
     cerr << "Invalid parameters: Please specify only one learner type.";
@@ -64,34 +77,34 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   if (vm.count("momentum")) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.01;
     double momentum = vm["momentum"].as<double>();
-    trainer = new MomentumSGDTrainer(&model, regularization_strength, learning_rate, momentum);
+    trainer = lazy ? (Trainer*)new LazyMomentumSGDTrainer(&model, regularization_strength, learning_rate, momentum) : new MomentumSGDTrainer(&model, regularization_strength, learning_rate, momentum);
   }
   else if (vm.count("adagrad")) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
-    trainer = new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
+    trainer = lazy ? (Trainer*)new LazyAdagradTrainer(&model, regularization_strength, learning_rate, eps) : new AdagradTrainer(&model, regularization_strength, learning_rate, eps);
   }
   else if (vm.count("adadelta")) {
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-6;
     double rho = (vm.count("rho")) ? vm["rho"].as<double>() : 0.95;
-    trainer = new AdadeltaTrainer(&model, regularization_strength, eps, rho);
+    trainer = lazy ? (Trainer*)new LazyAdadeltaTrainer(&model, regularization_strength, eps, rho) : new AdadeltaTrainer(&model, regularization_strength, eps, rho);
   }
   else if (vm.count("rmsprop")) {
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-20;
     double rho = (vm.count("rho")) ? vm["rho"].as<double>() : 0.95;
-    trainer = new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
+    trainer = lazy ? (Trainer*)new LazyRmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho) : new RmsPropTrainer(&model, regularization_strength, learning_rate, eps, rho);
   }
   else if (vm.count("adam")) {
     double alpha = (vm.count("alpha")) ? vm["alpha"].as<double>() : 0.001;
     double beta1 = (vm.count("beta1")) ? vm["beta1"].as<double>() : 0.9;
     double beta2 = (vm.count("beta2")) ? vm["beta2"].as<double>() : 0.999;
     double eps = (vm.count("epsilon")) ? vm["epsilon"].as<double>() : 1e-8;
-    trainer = new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
+    trainer = lazy ? (Trainer*)new LazyAdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps) : new AdamTrainer(&model, regularization_strength, alpha, beta1, beta2, eps);
   }
   else { /* sgd */
     double learning_rate = (vm.count("learning_rate")) ? vm["learning_rate"].as<double>() : 0.1;
-    trainer = new SimpleSGDTrainer(&model, regularization_strength, learning_rate);
+    trainer = lazy ? (Trainer*)new LazySGDTrainer(&model, regularization_strength, learning_rate) : new SimpleSGDTrainer(&model, regularization_strength, learning_rate);
   }
   assert (trainer != NULL);
 
@@ -100,3 +113,11 @@ Trainer* CreateTrainer(Model& model, const po::variables_map& vm) {
   return trainer;
 }
 
+// Brings every parameter up to date if the trainer updates lazily
+void FlushTrainer(Trainer* trainer) {
+  LazyTrainer* lazy_trainer = dynamic_cast<LazyTrainer*>(trainer);
+  if (lazy_trainer != nullptr) {
+    lazy_trainer->Flush();
+  }
+}
+
@@ -0,0 +1,196 @@
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include "training_loop.h"
+#include "lazy_trainer.h"
+
+cnn::real ProcessTree(const SyntaxTree& tree, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, bool backward, GraphMemoryMonitor& monitor, unsigned* node_count, unsigned* oversize_count, cnn::real weight) {
+  const unsigned tree_node_count = tree.NumNodes();
+  if (tree_node_count <= max_nodes) {
+    ComputationGraph cg;
+    model.BuildGraph(tree, cg, nullptr, weight);
+    cnn::real loss = as_scalar(cg.forward());
+    if (backward) {
+      cg.backward();
+    }
+    monitor.Observe();
+    *node_count += tree_node_count;
+    return loss;
+  }
+
+  (*oversize_count)++;
+  cnn::real loss = 0.0;
+  switch (limits.policy) {
+    case SKIP_OVERSIZE:
+      break;
+    case SPLIT_OVERSIZE:
+      for (const SyntaxTree* piece : SplitTree(tree, max_nodes)) {
+        // Lone terminals have no outputs to score
+        if (!piece->IsTerminal()) {
+          loss += ProcessTree(*piece, model, limits, max_nodes, backward, monitor, node_count, oversize_count, weight);
+        }
+      }
+      break;
+    case STREAM_OVERSIZE:
+      loss = StreamingLoss(model, tree, max_nodes, backward, &monitor, weight);
+      *node_count += tree_node_count;
+      break;
+    case CHECKPOINT_OVERSIZE:
+      loss = CheckpointedLoss(model, tree, max_nodes, backward, &monitor, weight);
+      *node_count += tree_node_count;
+      break;
+  }
+  return loss;
+}
+
+void CatchUpRows(Trainer* trainer, const SentimentModel& model, const vector<const SyntaxTree*>& trees) {
+  LazyTrainer* lazy_trainer = dynamic_cast<LazyTrainer*>(trainer);
+  if (lazy_trainer != nullptr) {
+    for (auto& rows : model.LookupRows(trees)) {
+      lazy_trainer->Touch(rows.first, rows.second);
+    }
+  }
+}
+
+cnn::real ProcessPreparedTree(const PreparedTree& prepared, SentimentModel& model, GraphMemoryMonitor& monitor, Trainer* trainer, AsyncUpdate* update, cnn::real weight) {
+  ComputationGraph cg;
+  model.BuildGraph(*prepared.tree, prepared.plan, cg, weight);
+  update->Wait();
+  CatchUpRows(trainer, model, {prepared.tree});
+  cnn::real loss = as_scalar(cg.forward());
+  cg.backward();
+  monitor.Observe();
+  return loss;
+}
+
+cnn::real ProcessBatch(const vector<const SyntaxTree*>& trees, SentimentModel& model, GraphMemoryMonitor& monitor, const vector<cnn::real>* weights) {
+  ComputationGraph cg;
+  model.BuildBatchGraph(trees, cg, weights);
+  cnn::real loss = as_scalar(cg.forward());
+  cg.backward();
+  monitor.Observe();
+  return loss;
+}
+
+cnn::real ProcessDistillation(const SyntaxTree& tree, const vector<cnn::real>& soft_targets, SentimentModel& model, cnn::real temperature, cnn::real soft_weight, unsigned max_nodes, GraphMemoryMonitor& monitor, unsigned* node_count, unsigned* oversize_count, cnn::real weight) {
+  const unsigned tree_node_count = tree.NumNodes();
+  if (tree_node_count > max_nodes) {
+    (*oversize_count)++;
+    return 0.0;
+  }
+  ComputationGraph cg;
+  model.BuildDistillationGraph(tree, soft_targets, temperature, soft_weight, cg, weight);
+  cnn::real loss = as_scalar(cg.forward());
+  cg.backward();
+  monitor.Observe();
+  *node_count += tree_node_count;
+  return loss;
+}
+
+vector<vector<cnn::real>> ComputeSoftTargets(const vector<SyntaxTree>& data, SentimentModel& teacher, unsigned max_nodes, cnn::real temperature, const volatile bool* stop) {
+  vector<vector<cnn::real>> soft_targets(data.size());
+  for (unsigned i = 0; i < data.size(); ++i) {
+    vector<vector<cnn::real>> scores;
+    for (auto& prediction : PredictStreaming(teacher, data[i], max_nodes, nullptr)) {
+      scores.push_back(get<1>(prediction));
+    }
+    soft_targets[i] = SentimentModel::SoftTargets(scores, temperature);
+    if (stop != nullptr && *stop) {
+      break;
+    }
+  }
+  return soft_targets;
+}
+
+pair<cnn::real, unsigned> ComputeLoss(const vector<SyntaxTree>& data, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, GraphMemoryMonitor& monitor, const volatile bool* stop) {
+  cnn::real loss = 0.0;
+  unsigned node_count = 0;
+  unsigned oversize_count = 0;
+  for (unsigned i = 0; i < data.size(); ++i) {
+    loss += ProcessTree(data[i], model, limits, max_nodes, false, monitor, &node_count, &oversize_count);
+    if (stop != nullptr && *stop) {
+      break;
+    }
+  }
+  return make_pair(loss, node_count);
+}
+
+LossEstimate ProgressiveLoss(const vector<SyntaxTree>& data, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, GraphMemoryMonitor& monitor, double threshold, double z, unsigned chunk_size, mt19937& rng, const volatile bool* stop) {
+  vector<unsigned> order(data.size());
+  iota(order.begin(), order.end(), 0);
+  shuffle(order.begin(), order.end(), rng);
+  // The variance needs at least two trees
+  chunk_size = max(chunk_size, 2U);
+
+  const double population = data.size();
+  double loss_sum = 0.0;
+  double loss_square_sum = 0.0;
+  unsigned node_count = 0;
+  unsigned oversize_count = 0;
+  unsigned scored = 0;
+  while (scored < order.size()) {
+    const cnn::real loss = ProcessTree(data[order[scored]], model, limits, max_nodes, false, monitor, &node_count, &oversize_count);
+    loss_sum += loss;
+    loss_square_sum += loss * loss;
+    scored++;
+    if (stop != nullptr && *stop) {
+      break;
+    }
+
+    if (z > 0.0 && scored % chunk_size == 0 && scored < order.size()) {
+      const double mean = loss_sum / scored;
+      const double variance = max(loss_square_sum - scored * mean * mean, 0.0) / (scored - 1);
+      const double standard_error = population * sqrt(variance / scored * (1.0 - scored / population));
+      if (population * mean - z * standard_error > threshold) {
+        break;
+      }
+    }
+  }
+
+  LossEstimate estimate;
+  estimate.tree_count = scored;
+  estimate.complete = (scored == order.size());
+  const double scale = (scored > 0) ? population / scored : 0.0;
+  estimate.loss = estimate.complete ? loss_sum : loss_sum * scale;
+  estimate.node_count = estimate.complete ? node_count : node_count * scale;
+  return estimate;
+}
+
+LossSampler::LossSampler(unsigned size, double decay, double uniform_fraction) : averages(size, 0.0), observed(size, false), decay(decay), uniform_fraction(uniform_fraction) {}
+
+void LossSampler::Observe(unsigned index, double loss) {
+  averages[index] = observed[index] ? decay * averages[index] + (1.0 - decay) * loss : loss;
+  observed[index] = true;
+}
+
+vector<unsigned> LossSampler::Sample(unsigned count, mt19937& rng, vector<double>* weights) const {
+  const unsigned size = averages.size();
+  double observed_sum = 0.0;
+  unsigned observed_count = 0;
+  for (unsigned i = 0; i < size; ++i) {
+    if (observed[i]) {
+      observed_sum += averages[i];
+      observed_count++;
+    }
+  }
+  const double default_loss = (observed_count > 0) ? observed_sum / observed_count : 1.0;
+  const double total = observed_sum + (size - observed_count) * default_loss;
+
+  vector<double> probabilities(size);
+  for (unsigned i = 0; i < size; ++i) {
+    const double loss = observed[i] ? averages[i] : default_loss;
+    probabilities[i] = uniform_fraction / size;
+    probabilities[i] += (total > 0.0) ? (1.0 - uniform_fraction) * loss / total : (1.0 - uniform_fraction) / size;
+  }
+
+  weights->resize(size);
+  for (unsigned i = 0; i < size; ++i) {
+    (*weights)[i] = 1.0 / (size * probabilities[i]);
+  }
+  discrete_distribution<unsigned> distribution(probabilities.begin(), probabilities.end());
+  vector<unsigned> indices(count);
+  for (unsigned& index : indices) {
+    index = distribution(rng);
+  }
+  return indices;
+}
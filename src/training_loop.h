@@ -0,0 +1,84 @@
+#pragma once
+#include <vector>
+#include <random>
+#include "cnn/cnn.h"
+#include "cnn/training.h"
+#include "sentiment.h"
+#include "memory.h"
+#include "syntax_tree.h"
+#include "pipeline.h"
+
+using namespace std;
+using namespace cnn;
+
+// Computes the loss of one tree, and its gradient if backward is set,
+// applying the oversize policy to trees with more than max_nodes nodes.
+// Adds the number of nodes actually scored to node_count. Here and below,
+// losses are multiplied by weight, e.g. a deduplicated tree's count.
+cnn::real ProcessTree(const SyntaxTree& tree, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, bool backward, GraphMemoryMonitor& monitor, unsigned* node_count, unsigned* oversize_count, cnn::real weight = 1.0);
+
+// With a LazyTrainer, applies the steps missed by the lookup rows that a
+// graph over trees will read. Call once any update in progress has
+// finished, before the graph runs forward. Other trainers are left alone.
+void CatchUpRows(Trainer* trainer, const SentimentModel& model, const vector<const SyntaxTree*>& trees);
+
+// Computes the loss and gradient of one tree that fits in a single graph,
+// building its graph from a plan while any update in progress finishes.
+// trainer's rows are then caught up, as by CatchUpRows().
+cnn::real ProcessPreparedTree(const PreparedTree& prepared, SentimentModel& model, GraphMemoryMonitor& monitor, Trainer* trainer, AsyncUpdate* update, cnn::real weight = 1.0);
+
+// Computes the loss and gradient of several trees in one graph, with
+// weights optionally giving one weight per tree
+cnn::real ProcessBatch(const vector<const SyntaxTree*>& trees, SentimentModel& model, GraphMemoryMonitor& monitor, const vector<cnn::real>* weights = nullptr);
+
+// Computes the distillation loss and gradient of one tree. Trees with more
+// than max_nodes nodes are skipped.
+cnn::real ProcessDistillation(const SyntaxTree& tree, const vector<cnn::real>& soft_targets, SentimentModel& model, cnn::real temperature, cnn::real soft_weight, unsigned max_nodes, GraphMemoryMonitor& monitor, unsigned* node_count, unsigned* oversize_count, cnn::real weight = 1.0);
+
+// Runs the teacher over each tree, returning its soft targets for every
+// tree in the order BuildDistillationGraph() expects them.
+// The loops below give up early once *stop is set.
+vector<vector<cnn::real>> ComputeSoftTargets(const vector<SyntaxTree>& data, SentimentModel& teacher, unsigned max_nodes, cnn::real temperature, const volatile bool* stop = nullptr);
+
+// Returns the total loss over data and the number of nodes it covers
+pair<cnn::real, unsigned> ComputeLoss(const vector<SyntaxTree>& data, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, GraphMemoryMonitor& monitor, const volatile bool* stop = nullptr);
+
+struct LossEstimate {
+  double loss; // The total loss over the data set, estimated unless complete
+  double node_count; // Likewise
+  unsigned tree_count; // Number of trees actually scored
+  bool complete;
+};
+
+// Like ComputeLoss(), but scores data in a random order and gives up early
+// once the total loss is clearly above threshold: after each chunk_size
+// trees, it stops if the estimated total is more than z standard errors
+// over threshold, using the standard error of a sample drawn without
+// replacement. Anything that might beat threshold gets a complete pass.
+// z <= 0 always scores everything.
+LossEstimate ProgressiveLoss(const vector<SyntaxTree>& data, SentimentModel& model, const TreeLimits& limits, unsigned max_nodes, GraphMemoryMonitor& monitor, double threshold, double z, unsigned chunk_size, mt19937& rng, const volatile bool* stop = nullptr);
+
+// Keeps a moving average of each training tree's loss, and draws trees in
+// proportion to it, so that trees the model already gets right are rarely
+// trained on. Part of the probability is spread uniformly, so that every
+// tree is revisited now and then. A tree drawn with probability p gets an
+// importance weight of 1 / (size p): weighting its loss by that keeps the
+// expected gradient the same as under uniform sampling.
+class LossSampler {
+public:
+  // Each observation keeps decay of a tree's average. uniform_fraction of
+  // the probability is spread evenly, which bounds the weights at
+  // 1 / uniform_fraction.
+  LossSampler(unsigned size, double decay, double uniform_fraction);
+
+  void Observe(unsigned index, double loss);
+  // Draws count trees, with replacement, and sets every tree's importance
+  // weight. Trees not yet observed count as having the average loss.
+  vector<unsigned> Sample(unsigned count, mt19937& rng, vector<double>* weights) const;
+
+private:
+  vector<double> averages;
+  vector<bool> observed;
+  const double decay;
+  const double uniform_fraction;
+};
@@ -12,8 +12,6 @@ using namespace cnn::expr;
 
 namespace cnn {
 
-enum { X2I, BI, X2F, BF, X2O, BO, X2C, BC };
-enum { H2I, H2F, H2O, H2C, C2I, C2F, C2O };
 // See "Improved Semantic Representations From Tree-Structured Long Short-Term Memory Networks"
 // by Tai, Socher, and Manning (2015), section 3.2, for details on this model.
 // http://arxiv.org/pdf/1503.00075v3.pdf
@@ -97,6 +95,15 @@ void TreeLSTMBuilder::new_graph_impl(ComputationGraph& cg) {
   }
 }
 
+// The bias and input terms of one gate's affine transform. An empty input
+// stands for all zeros, so its product is left out altogether.
+static vector<Expression> InputTerms(const vector<Expression>& vars, unsigned bias, unsigned weight, const Expression& in) {
+  if (in.pg == nullptr) {
+    return {vars[bias]};
+  }
+  return {vars[bias], vars[weight], in};
+}
+
 Expression TreeLSTMBuilder::LookupParameter(unsigned layer, unsigned p_type, unsigned value) {
   if (lparam_vars[layer][p_type][value].i == 0) {
     LookupParameters* p = lparams[layer][p_type];
@@ -124,9 +131,24 @@ void TreeLSTMBuilder::start_new_sequence_impl(const vector<Expression>& hinit) {
   }
 }
 
+void TreeLSTMBuilder::set_state(int id, const vector<Expression>& node_h, const vector<Expression>& node_c) {
+  assert (node_h.size() == layers);
+  assert (node_c.size() == layers);
+  if (h.size() <= (unsigned)id) {
+    h.resize(id + 1);
+    c.resize(id + 1);
+  }
+  h[id] = node_h;
+  c[id] = node_c;
+}
+
 Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expression& x) {
-  assert (h.size() == id);
-  assert (c.size() == id);
+  // Ids below this one may belong to nodes that were never added to this
+  // graph (e.g. when evaluating only a subtree), so leave gaps for them.
+  assert (h.size() <= (unsigned)id);
+  assert (c.size() <= (unsigned)id);
+  h.resize(id);
+  c.resize(id);
   h.push_back(vector<Expression>(layers));
   c.push_back(vector<Expression>(layers));
   vector<Expression>& ht = h.back();
@@ -160,7 +182,8 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
     // input
     Expression i_ait;
     if (has_prev_state) {
-      vector<Expression> xs = {vars[BI], vars[X2I], in};
+      vector<Expression> xs = InputTerms(vars, BI, X2I, in);
+      const unsigned input_terms = xs.size();
       xs.reserve(4 * children.size() + 3);
       for (unsigned j = 0; j < children.size(); ++j) {
         unsigned ej = (j < N) ? j : N - 1;
@@ -169,11 +192,11 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
         xs.push_back(LookupParameter(i, C2I, ej));
         xs.push_back(i_c_children[j]);
       }
-      assert (xs.size() == 4 * children.size() + 3);
+      assert (xs.size() == 4 * children.size() + input_terms);
       i_ait = affine_transform(xs);
     }
     else
-      i_ait = affine_transform({vars[BI], vars[X2I], in});
+      i_ait = affine_transform(InputTerms(vars, BI, X2I, in));
     Expression i_it = logistic(i_ait);
 
     // forget
@@ -182,7 +205,8 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
       unsigned ek = (k < N) ? k : N - 1;
       Expression i_aft;
       if (has_prev_state) {
-        vector<Expression> xs = {vars[BF], vars[X2F], in};
+        vector<Expression> xs = InputTerms(vars, BF, X2F, in);
+        const unsigned input_terms = xs.size();
         xs.reserve(4 * children.size() + 3);
         for (unsigned j = 0; j < children.size(); ++j) {
           unsigned ej = (j < N) ? j : N - 1;
@@ -191,18 +215,19 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
           xs.push_back(LookupParameter(i, C2F, ej * N + ek));
           xs.push_back(i_c_children[j]);
         }
-        assert (xs.size() == 4 * children.size() + 3);
+        assert (xs.size() == 4 * children.size() + input_terms);
         i_aft = affine_transform(xs);
       }
       else
-        i_ait = affine_transform({vars[BF], vars[X2F], in});
+        i_ait = affine_transform(InputTerms(vars, BF, X2F, in));
       i_ft.push_back(logistic(i_aft));
     }
 
     // write memory cell
     Expression i_awt;
     if (has_prev_state) {
-      vector<Expression> xs = {vars[BC], vars[X2C], in};
+      vector<Expression> xs = InputTerms(vars, BC, X2C, in);
+      const unsigned input_terms = xs.size();
       // This is the one and only place that should *not* condition on i_c_children
       // This should condition only on x (a.k.a. in), the bias (vars[BC]) and i_h_children
       xs.reserve(2 * children.size() + 3);
@@ -211,11 +236,11 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
         xs.push_back(LookupParameter(i, H2C, ej));
         xs.push_back(i_h_children[j]);
       }
-      assert (xs.size() == 2 * children.size() + 3);
+      assert (xs.size() == 2 * children.size() + input_terms);
       i_awt = affine_transform(xs);
     }
     else
-      i_awt = affine_transform({vars[BC], vars[X2C], in});
+      i_awt = affine_transform(InputTerms(vars, BC, X2C, in));
     Expression i_wt = tanh(i_awt);
 
     // compute new cell value
@@ -235,7 +260,8 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
     // output
     Expression i_aot;
     if (has_prev_state) {
-      vector<Expression> xs = {vars[BO], vars[X2O], in};
+      vector<Expression> xs = InputTerms(vars, BO, X2O, in);
+      const unsigned input_terms = xs.size();
       xs.reserve(4 * children.size() + 3);
       for (unsigned j = 0; j < children.size(); ++j) {
         unsigned ej = (j < N) ? j : N - 1;
@@ -244,11 +270,11 @@ Expression TreeLSTMBuilder::add_input(int id, vector<int> children, const Expres
         xs.push_back(LookupParameter(i, C2O, ej));
         xs.push_back(i_c_children[j]);
       }
-      assert (xs.size() == 4 * children.size() + 3);
+      assert (xs.size() == 4 * children.size() + input_terms);
       i_aot = affine_transform(xs);
     }
     else
-      i_aot = affine_transform({vars[BO], vars[X2O], in});
+      i_aot = affine_transform(InputTerms(vars, BO, X2O, in));
     Expression i_ot = logistic(i_aot);
 
     // Compute new h value
@@ -12,6 +12,10 @@ namespace cnn {
 class Model;
 
 struct TreeLSTMBuilder : public RNNBuilder {
+  // Indices into each layer's params and lparams
+  enum { X2I, BI, X2F, BF, X2O, BO, X2C, BC };
+  enum { H2I, H2F, H2O, H2C, C2I, C2F, C2O };
+
   TreeLSTMBuilder() = default;
   explicit TreeLSTMBuilder(unsigned N, //Max branching factor
                        unsigned layers,
@@ -28,7 +32,11 @@ struct TreeLSTMBuilder : public RNNBuilder {
   }
   unsigned num_h0_components() const override { return 2 * layers; }
   void copy(const RNNBuilder & params) override;
+  // An empty x stands for an all-zero input, and skips the input products
   Expression add_input(int id, std::vector<int> children, const Expression& x);
+  // Uses externally computed h and c (one per layer) as the state of node id,
+  // e.g. for a subtree that was evaluated in a different graph.
+  void set_state(int id, const std::vector<Expression>& node_h, const std::vector<Expression>& node_c);
  protected:
   void new_graph_impl(ComputationGraph& cg) override;
   void start_new_sequence_impl(const std::vector<Expression>& h0) override;
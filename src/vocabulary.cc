@@ -0,0 +1,342 @@
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vocabulary.h"
+
+namespace {
+const uint64_t kBlobMagic = 0x31304241434f5653ULL; // "SVOCAB01", little-endian
+
+struct BlobHeader {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t table_size;
+  uint64_t arena_bytes;
+  uint64_t frozen;
+  int64_t unk_id;
+};
+
+bool IsValidTableSize(uint64_t n) {
+  return n > 0 && (n & (n - 1)) == 0;
+}
+
+size_t Align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+// Byte offsets of each section of a blob, relative to its start
+struct BlobLayout {
+  explicit BlobLayout(const BlobHeader& header) {
+    hashes = sizeof(BlobHeader);
+    offsets = hashes + header.size * sizeof(uint64_t);
+    table = offsets + Align8((header.size + 1) * sizeof(uint32_t));
+    arena = table + Align8(header.table_size * sizeof(int32_t));
+    end = arena + Align8(header.arena_bytes);
+  }
+  size_t hashes, offsets, table, arena, end;
+};
+
+// Reads the header of the blob at data and checks everything a lookup
+// relies on against length, so that a corrupt blob can't send one out of
+// bounds: the section sizes, the word offsets, the table's ids, which
+// must leave at least one slot empty, and the unknown word. Hashes and
+// the words themselves are not read, apart from the arena's last byte.
+bool ValidateBlob(const char* data, size_t length, BlobHeader* header) {
+  if (length < sizeof(BlobHeader)) {
+    return false;
+  }
+  memcpy(header, data, sizeof(BlobHeader));
+  if (header->magic != kBlobMagic || !IsValidTableSize(header->table_size) || header->size >= header->table_size ||
+      header->table_size > length / sizeof(int32_t) || header->arena_bytes > length) {
+    return false;
+  }
+  BlobLayout layout(*header);
+  if (length < layout.end || header->unk_id < -1 || header->unk_id >= (int64_t)header->size) {
+    return false;
+  }
+
+  const uint32_t* offsets = (const uint32_t*)(data + layout.offsets);
+  if (offsets[0] != 0 || offsets[header->size] != header->arena_bytes || (header->arena_bytes > 0 && data[layout.arena + header->arena_bytes - 1] != '\0')) {
+    return false;
+  }
+  for (uint64_t i = 0; i < header->size; ++i) {
+    if (offsets[i + 1] <= offsets[i]) {
+      return false;
+    }
+  }
+  const int32_t* table = (const int32_t*)(data + layout.table);
+  bool has_empty_slot = false;
+  for (uint64_t slot = 0; slot < header->table_size; ++slot) {
+    if (table[slot] < -1 || table[slot] >= (int64_t)header->size) {
+      return false;
+    }
+    has_empty_slot |= (table[slot] == -1);
+  }
+  return has_empty_slot;
+}
+} // namespace
+
+Vocabulary::Vocabulary() : offsets(1, 0), table(16, -1), frozen(false), unk_id(-1), mapping(nullptr), mapping_length(0) {
+  UpdateViews();
+}
+
+Vocabulary::~Vocabulary() {
+  Unmap();
+}
+
+void Vocabulary::Unmap() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_length);
+    mapping = nullptr;
+    mapping_length = 0;
+  }
+}
+
+void Vocabulary::UpdateViews() {
+  size_ = hashes.size();
+  hash_view = hashes.data();
+  offset_view = offsets.data();
+  table_view = table.data();
+  table_mask = table.size() - 1;
+  arena_view = arena.data();
+}
+
+unsigned Vocabulary::size() const {
+  return size_;
+}
+
+bool Vocabulary::Contains(const string& word) const {
+  return Contains(word.c_str(), word.length());
+}
+
+bool Vocabulary::Contains(const char* word, size_t length) const {
+  return Lookup(word, length) >= 0;
+}
+
+void Vocabulary::Freeze() {
+  frozen = true;
+}
+
+bool Vocabulary::is_frozen() const {
+  return frozen;
+}
+
+void Vocabulary::Clear() {
+  Unmap();
+  hashes.clear();
+  offsets.assign(1, 0);
+  table.assign(16, -1);
+  arena.clear();
+  frozen = false;
+  unk_id = -1;
+  UpdateViews();
+}
+
+void Vocabulary::SetUnk(const string& word) {
+  unk_id = Lookup(word.c_str(), word.length());
+  if (unk_id < 0) {
+    assert (!frozen);
+    unk_id = Convert(word);
+  }
+}
+
+uint64_t Vocabulary::Hash(const char* word, size_t length) {
+  // 64-bit FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; ++i) {
+    h ^= (unsigned char)word[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+WordId Vocabulary::Lookup(const char* word, size_t length) const {
+  const uint64_t h = Hash(word, length);
+  for (size_t slot = h & table_mask; table_view[slot] >= 0; slot = (slot + 1) & table_mask) {
+    const WordId id = table_view[slot];
+    if (hash_view[id] == h && Length(id) == length && memcmp(arena_view + offset_view[id], word, length) == 0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+WordId Vocabulary::Convert(const string& word) {
+  return Convert(word.c_str(), word.length());
+}
+
+WordId Vocabulary::Convert(const char* word, size_t length) {
+  WordId id = Lookup(word, length);
+  if (id >= 0) {
+    return id;
+  }
+
+  if (frozen) {
+    if (unk_id >= 0) {
+      return unk_id;
+    }
+    cerr << "Unknown word encountered: " << string(word, length) << endl;
+    throw runtime_error("Unknown word encountered in frozen vocabulary");
+  }
+
+  Insert(word, length, Hash(word, length));
+  return size_ - 1;
+}
+
+const char* Vocabulary::Convert(WordId id) const {
+  assert (id >= 0 && (unsigned)id < size_);
+  return arena_view + offset_view[id];
+}
+
+size_t Vocabulary::Length(WordId id) const {
+  assert (id >= 0 && (unsigned)id < size_);
+  return offset_view[id + 1] - offset_view[id] - 1;
+}
+
+void Vocabulary::Insert(const char* word, size_t length, uint64_t hash) {
+  assert (mapping == nullptr);
+  const WordId id = hashes.size();
+  hashes.push_back(hash);
+  arena.insert(arena.end(), word, word + length);
+  arena.push_back('\0');
+  offsets.push_back(arena.size());
+
+  // Keep the table at most half full
+  if (2 * hashes.size() > table.size()) {
+    Rehash(2 * table.size());
+  }
+  else {
+    size_t mask = table.size() - 1;
+    size_t slot = hash & mask;
+    while (table[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = id;
+  }
+  UpdateViews();
+}
+
+void Vocabulary::Rehash(size_t table_size) {
+  assert ((table_size & (table_size - 1)) == 0);
+  table.assign(table_size, -1);
+  size_t mask = table_size - 1;
+  for (unsigned id = 0; id < hashes.size(); ++id) {
+    size_t slot = hashes[id] & mask;
+    while (table[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    table[slot] = id;
+  }
+}
+
+void Vocabulary::SaveBlob(ostream& out) const {
+  BlobHeader header;
+  header.magic = kBlobMagic;
+  header.size = size_;
+  header.table_size = table_mask + 1;
+  header.arena_bytes = offset_view[size_];
+  header.frozen = frozen ? 1 : 0;
+  header.unk_id = unk_id;
+  BlobLayout layout(header);
+
+  string blob(layout.end, '\0');
+  memcpy(&blob[0], &header, sizeof(header));
+  memcpy(&blob[layout.hashes], hash_view, header.size * sizeof(uint64_t));
+  memcpy(&blob[layout.offsets], offset_view, (header.size + 1) * sizeof(uint32_t));
+  memcpy(&blob[layout.table], table_view, header.table_size * sizeof(int32_t));
+  memcpy(&blob[layout.arena], arena_view, header.arena_bytes);
+  out.write(blob.data(), blob.size());
+}
+
+void Vocabulary::LoadBlob(const string& blob) {
+  BlobHeader header;
+  if (blob.size() < sizeof(header)) {
+    throw runtime_error("Vocabulary blob is truncated");
+  }
+  if (!ValidateBlob(blob.data(), blob.size(), &header)) {
+    throw runtime_error("Invalid vocabulary blob");
+  }
+  BlobLayout layout(header);
+
+  Unmap();
+  const char* data = blob.data();
+  hashes.assign((const uint64_t*)(data + layout.hashes), (const uint64_t*)(data + layout.hashes) + header.size);
+  offsets.assign((const uint32_t*)(data + layout.offsets), (const uint32_t*)(data + layout.offsets) + header.size + 1);
+  table.assign((const int32_t*)(data + layout.table), (const int32_t*)(data + layout.table) + header.table_size);
+  arena.assign(data + layout.arena, data + layout.arena + header.arena_bytes);
+  frozen = header.frozen != 0;
+  unk_id = header.unk_id;
+  UpdateViews();
+}
+
+void Vocabulary::LoadDict(const vector<string>& words, const unordered_map<string, int>& ids, bool dict_frozen, bool map_unk, int dict_unk_id) {
+  if (ids.size() != words.size() || (map_unk && (dict_unk_id < 0 || (size_t)dict_unk_id >= words.size()))) {
+    throw runtime_error("Invalid cnn::Dict vocabulary");
+  }
+  Clear();
+  for (unsigned id = 0; id < words.size(); ++id) {
+    auto it = ids.find(words[id]);
+    if (it == ids.end() || it->second != (int)id) {
+      throw runtime_error("Invalid cnn::Dict vocabulary");
+    }
+    Insert(words[id].c_str(), words[id].length(), Hash(words[id].c_str(), words[id].length()));
+  }
+  frozen = dict_frozen;
+  unk_id = map_unk ? dict_unk_id : -1;
+}
+
+size_t Vocabulary::MapFrom(const char* data, size_t length) {
+  BlobHeader header;
+  if ((uintptr_t)data % 8 != 0 || !ValidateBlob(data, length, &header)) {
+    return 0;
+  }
+  BlobLayout layout(header);
+
+  Unmap();
+  hashes.clear();
+  offsets.clear();
+  table.clear();
+  arena.clear();
+  size_ = header.size;
+  hash_view = (const uint64_t*)(data + layout.hashes);
+  offset_view = (const uint32_t*)(data + layout.offsets);
+  table_view = (const int32_t*)(data + layout.table);
+  table_mask = header.table_size - 1;
+  arena_view = data + layout.arena;
+  frozen = true;
+  unk_id = header.unk_id;
+  return layout.end;
+}
+
+bool Vocabulary::Map(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void* region = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    return false;
+  }
+
+  // Nothing is replaced until the new blob is known to be valid, so a
+  // failure leaves the current words in place
+  BlobHeader header;
+  if (!ValidateBlob((const char*)region, st.st_size, &header)) {
+    munmap(region, st.st_size);
+    return false;
+  }
+  Unmap();
+  MapFrom((const char*)region, st.st_size);
+  mapping = region;
+  mapping_length = st.st_size;
+  return true;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include <unordered_map>
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/unordered_map.hpp>
+#include <boost/serialization/version.hpp>
+
+using namespace std;
+
+typedef int WordId;
+
+// A string <-> id map that keeps every word in one contiguous arena and
+// finds them through an open-addressing hash table of ids, with each
+// word's hash stored alongside it.
+//
+// Adding words is not thread-safe, but once the vocabulary is frozen any
+// number of threads may look words up at once without locking.
+//
+// The whole structure can be written out as a single blob and used again
+// without rehashing, either by copying it in (e.g. from a model archive)
+// or by mapping a blob file directly into memory with Map().
+class Vocabulary {
+public:
+  Vocabulary();
+  ~Vocabulary();
+  Vocabulary(const Vocabulary&) = delete;
+  Vocabulary& operator=(const Vocabulary&) = delete;
+
+  unsigned size() const;
+  bool Contains(const string& word) const;
+  bool Contains(const char* word, size_t length) const;
+  void Freeze();
+  bool is_frozen() const;
+  // Removes every word, leaving an empty, unfrozen vocabulary with no UNK
+  void Clear();
+  // Unknown words map to this word once the vocabulary is frozen.
+  // Without it, converting an unknown word in a frozen vocabulary throws.
+  void SetUnk(const string& word);
+
+  // Adds word if it's new and the vocabulary is not frozen
+  WordId Convert(const string& word);
+  WordId Convert(const char* word, size_t length);
+  // Returns -1 instead of adding or mapping unknown words
+  WordId Lookup(const char* word, size_t length) const;
+  // The returned string stays valid until the next word is added
+  const char* Convert(WordId id) const;
+  size_t Length(WordId id) const;
+
+  static uint64_t Hash(const char* word, size_t length);
+
+  // Serializes everything as one blob, suitable for Map() or LoadBlob()
+  void SaveBlob(ostream& out) const;
+  void LoadBlob(const string& blob);
+  // Memory-maps a blob file written by SaveBlob(). The result is frozen.
+  // Returns false, leaving the vocabulary unchanged, if the file can't be
+  // mapped or isn't a valid blob.
+  bool Map(const string& filename);
+  // Uses the blob at the start of data, which is length bytes long, in
+  // place. data must be 8-byte aligned and outlive this vocabulary.
+  // Returns the blob's size in bytes, or 0 if data does not hold a valid
+  // blob, in which case the vocabulary is left unchanged.
+  size_t MapFrom(const char* data, size_t length);
+  // Replaces the contents with the words of a cnn::Dict, as read from an
+  // old model archive. Throws if they aren't consistent.
+  void LoadDict(const vector<string>& words, const unordered_map<string, int>& ids, bool dict_frozen, bool map_unk, int dict_unk_id);
+
+private:
+  void Insert(const char* word, size_t length, uint64_t hash);
+  void Rehash(size_t table_size);
+  void UpdateViews();
+  void Unmap();
+
+  // Owned storage, used while building or after LoadBlob()
+  vector<uint64_t> hashes;
+  vector<uint32_t> offsets; // size() + 1 entries; word i is [offsets[i], offsets[i + 1] - 1), NUL terminated
+  vector<int32_t> table; // Power-of-two sized; -1 marks an empty slot
+  vector<char> arena;
+
+  // Views of either the owned storage or a mapped blob
+  unsigned size_;
+  const uint64_t* hash_view;
+  const uint32_t* offset_view;
+  const int32_t* table_view;
+  size_t table_mask;
+  const char* arena_view;
+
+  bool frozen;
+  WordId unk_id;
+  void* mapping;
+  size_t mapping_length;
+
+  friend class boost::serialization::access;
+  template<class Archive> void save(Archive& ar, const unsigned int) const {
+    ostringstream ss;
+    SaveBlob(ss);
+    string blob = ss.str();
+    ar & blob;
+  }
+  template<class Archive> void load(Archive& ar, const unsigned int version) {
+    // Version 0 archives were written by cnn::Dict, before Vocabulary
+    if (version == 0) {
+      bool dict_frozen, map_unk;
+      int dict_unk_id;
+      vector<string> words;
+      unordered_map<string, int> ids;
+      ar & dict_frozen;
+      ar & map_unk;
+      ar & dict_unk_id;
+      ar & words;
+      ar & ids;
+      LoadDict(words, ids, dict_frozen, map_unk, dict_unk_id);
+      return;
+    }
+    string blob;
+    ar & blob;
+    LoadBlob(blob);
+  }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+BOOST_CLASS_VERSION(Vocabulary, 1)
@@ -0,0 +1,116 @@
+#include <cassert>
+#include "work_stealing.h"
+
+// The pool and index of the worker the current thread is, if any
+static thread_local WorkStealingPool* current_pool = nullptr;
+static thread_local unsigned current_worker = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned num_threads) : queued(0), pending(0), stopping(false) {
+  num_threads = max(num_threads, 1U);
+  for (unsigned i = 0; i < num_threads; ++i) {
+    workers.push_back(unique_ptr<Worker>(new Worker()));
+  }
+  for (unsigned i = 1; i < num_threads; ++i) {
+    threads.push_back(thread(&WorkStealingPool::WorkerLoop, this, i));
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    lock_guard<mutex> guard(wake_lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread& t : threads) {
+    t.join();
+  }
+}
+
+unsigned WorkStealingPool::size() const {
+  return workers.size();
+}
+
+void WorkStealingPool::Push(unsigned worker, Task task) {
+  pending++;
+  {
+    lock_guard<mutex> guard(workers[worker]->lock);
+    workers[worker]->tasks.push_back(move(task));
+  }
+  // Taking wake_lock orders this with a sleeping worker's check of queued
+  {
+    lock_guard<mutex> guard(wake_lock);
+    queued++;
+  }
+  wake.notify_one();
+}
+
+void WorkStealingPool::Spawn(Task task) {
+  assert (current_pool == this);
+  Push(current_worker, move(task));
+}
+
+// Runs one task, from our own deque if possible, and otherwise stolen from
+// another worker. Returns false if there was nothing to run.
+bool WorkStealingPool::RunOne(unsigned self) {
+  Task task;
+  {
+    Worker& own = *workers[self];
+    lock_guard<mutex> guard(own.lock);
+    if (own.tasks.size() > 0) {
+      task = move(own.tasks.back());
+      own.tasks.pop_back();
+    }
+  }
+  for (unsigned i = 1; !task && i < workers.size(); ++i) {
+    Worker& victim = *workers[(self + i) % workers.size()];
+    lock_guard<mutex> guard(victim.lock);
+    if (victim.tasks.size() > 0) {
+      task = move(victim.tasks.front());
+      victim.tasks.pop_front();
+    }
+  }
+  if (!task) {
+    return false;
+  }
+
+  queued--;
+  task();
+  pending--;
+  return true;
+}
+
+void WorkStealingPool::WorkerLoop(unsigned self) {
+  current_pool = this;
+  current_worker = self;
+  while (true) {
+    if (RunOne(self)) {
+      continue;
+    }
+    unique_lock<mutex> guard(wake_lock);
+    wake.wait(guard, [this] { return stopping || queued > 0; });
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+void WorkStealingPool::Run(const vector<Task>& tasks) {
+  assert (pending == 0);
+  WorkStealingPool* outer_pool = current_pool;
+  unsigned outer_worker = current_worker;
+  current_pool = this;
+  current_worker = 0;
+
+  // Deal the initial tasks out so that every thread starts with its own share
+  for (unsigned i = 0; i < tasks.size(); ++i) {
+    Push(i % workers.size(), tasks[i]);
+  }
+  while (pending > 0) {
+    if (!RunOne(0)) {
+      this_thread::yield();
+    }
+  }
+
+  current_pool = outer_pool;
+  current_worker = outer_worker;
+}
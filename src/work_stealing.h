@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+// A fixed set of threads, each with its own deque of tasks. A thread runs
+// the newest task on its own deque first and, once that's empty, steals the
+// oldest task from another thread's deque, so that related work tends to
+// stay on one core while idle cores still pick up large independent pieces.
+class WorkStealingPool {
+public:
+  typedef function<void()> Task;
+
+  // The thread calling Run() is one of the num_threads threads
+  explicit WorkStealingPool(unsigned num_threads);
+  ~WorkStealingPool();
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  // Runs tasks, and every task they Spawn(), returning once all are done.
+  // Only one thread may be inside Run() at a time.
+  void Run(const vector<Task>& tasks);
+  // Queues a task on the calling thread's own deque. Only valid from inside
+  // a task that this pool is running.
+  void Spawn(Task task);
+  unsigned size() const;
+
+private:
+  struct Worker {
+    mutex lock;
+    deque<Task> tasks;
+  };
+
+  void Push(unsigned worker, Task task);
+  bool RunOne(unsigned self);
+  void WorkerLoop(unsigned self);
+
+  vector<unique_ptr<Worker>> workers; // workers[0] belongs to the caller of Run()
+  vector<thread> threads;
+  atomic<unsigned> queued;  // Tasks sitting in some deque
+  atomic<unsigned> pending; // Tasks queued or running
+  mutex wake_lock;
+  condition_variable wake;
+  bool stopping;
+};